@@ -1,14 +1,19 @@
 /// MetricTree.h
 /// Author(s): Shaun Harker
 /// Date: June 29, 2014
+#ifndef METRICTREE_H
+#define METRICTREE_H
+
 #include <limits>
 #include <vector>
 #include <set>
 #include <stack>
 #include <fstream>
 #include <typeinfo>
+#include <stdexcept>
 #include "boost/shared_ptr.hpp"
 #include "boost/foreach.hpp"
+#include "boost/optional.hpp"
 
 /// Forward declarations
 namespace MetricTree_detail {
@@ -19,6 +24,47 @@ namespace MetricTree_detail {
   template < class T, class D > class KNearestException;
   template < class T, class D > class AspirationException;
   template < class T, class D > class DeltaCloseException;
+
+  /// probe
+  ///   Put the distance between x and y in "result" and return true,
+  ///   or return false if it is not available. Distance functors with
+  ///   a "probe" method (returning an optional distance) report a
+  ///   missing distance by return value; others by throwing. Such a
+  ///   "probe" may take the "bound" the distance is to be compared 
+  ///   with, and return a lower bound exceeding it instead.
+  template < class D, class T > auto
+  probe ( D & distance, T const& x, T const& y, double bound, double * result, int ) 
+    -> decltype ( distance . probe ( x, y, bound ), bool () ) {
+    boost::optional<double> d = distance . probe ( x, y, bound );
+    if ( d ) * result = * d;
+    return (bool) d;
+  }
+  template < class D, class T > bool
+  probe ( D & distance, T const& x, T const& y, double bound, double * result, long ) {
+    try {
+      * result = distance ( x, y );
+      return true;
+    } catch (...) {
+      return false;
+    }
+  }
+
+  /// filter
+  ///   Put a lower bound on the distance between x and y exceeding
+  ///   "bound" in "result" and return true, if the distance functor 
+  ///   has a "filter" method (returning an optional lower bound from 
+  ///   cheap bounds) which finds one. Otherwise return false.
+  template < class D, class T > auto
+  filter ( D & distance, T const& x, T const& y, double bound, double * result, int ) 
+    -> decltype ( distance . filter ( x, y, bound ), bool () ) {
+    boost::optional<double> d = distance . filter ( x, y, bound );
+    if ( d ) * result = * d;
+    return (bool) d;
+  }
+  template < class D, class T > bool
+  filter ( D & distance, T const& x, T const& y, double bound, double * result, long ) {
+    return false;
+  }
 }
 
 /// class MetricTree
@@ -105,6 +151,13 @@ public:
   iterator 
   nearest ( T const& x ) const;
 
+  /// nearest (bounded)
+  ///   Find closest point to x among points closer
+  ///   than "bound", and return an iterator pointing 
+  ///   to it. If there are none, return end().
+  iterator 
+  nearest ( T const& x, double bound ) const;
+
   /// nearest (exceptional)
   ///   Used for resuming "nearest" after it throws
   iterator 
@@ -147,13 +200,22 @@ public:
   deltaClose ( DeltaCloseException & e ) const;
 
   /// getDistance 
-  ///    Return the distance between x and y
+  ///    Return the distance between x and y, or a lower bound on it
+  ///    exceeding "bound" (if it is only compared with "bound")
   ///    If an errors occurs, put (x,y) in e
   ///    and throw e
   double 
   getDistance ( T const& x,
                 T const& y, 
-                Exception & e ) const;
+                Exception & e,
+                double bound = std::numeric_limits<double>::infinity() ) const;
+
+  /// threshold
+  ///   Return the largest value the distance from the query of "e" to
+  ///   the point of "it" is compared with by search: a larger distance
+  ///   prunes the subtree of "it", whatever it is exactly
+  double 
+  threshold ( SearchException const& e, iterator it ) const;
 
   /// search
   ///   Used as a helper method by various search 
@@ -221,6 +283,19 @@ public:
   iterator
   insertAsRight ( iterator n, T const& x ); 
 
+  /// restore
+  ///    Replace the contents of the tree with "points" arranged
+  ///    according to the given topology. The arrays are indexed
+  ///    as by "index", and -1 denotes a missing node (as reported
+  ///    by left, right, and parent). Used to rebuild a tree from
+  ///    a checkpoint.
+  void
+  restore ( std::vector<T> const& points,
+            std::vector<int64_t> const& left,
+            std::vector<int64_t> const& right,
+            std::vector<int64_t> const& parent,
+            std::vector<double> const& radius );
+
   /// graphVizDebug
   ///    Create a .gv file illustrating the data structure
   void
@@ -269,18 +344,16 @@ size ( void ) const {
 template < class T, class D > double MetricTree<T,D>::
 getDistance ( T const& x,
               T const& y, 
-              Exception & e ) const {
+              Exception & e,
+              double bound ) const {
   double result;
   //std::cout << "getDistance. x = " << x << " y = " << y << "\n";
-  try {
-    //std::cout << "MetricTree::getDistance. this = " << this << " and distance_ = " << distance_ << "\n";
-    result = (*distance_) ( x, y );
-    //std::cout << "result = " << result << "\n";
-    //abort ();
-  } catch (...) {
-    //std::cout << "MetricTree::getDistance. Caught the exception.\n";
+  // Cheap bounds may decide the comparison before the distance is needed
+  if ( MetricTree_detail::filter ( *distance_, x, y, bound, &result, 0 ) ) return result;
+  if ( not MetricTree_detail::probe ( *distance_, x, y, bound, &result, 0 ) ) {
     //std::cout << "MetricTree::getDistance. Need (" << x << "; " << y << ")\n";
     e . calculations -> push ( std::make_pair ( x, y ) );
+    e . bounds -> push ( bound );
     e . raise ();
   }
   return result;
@@ -381,9 +454,16 @@ insert ( InsertException & e ) {
 template < class T, class D >
 typename MetricTree<T,D>::iterator MetricTree<T,D>::
 nearest ( T const& x ) const { 
+  return nearest ( x, std::numeric_limits<double>::infinity() );
+}
+
+template < class T, class D >
+typename MetricTree<T,D>::iterator MetricTree<T,D>::
+nearest ( T const& x, double bound ) const { 
   NearestException e;
   e . x . reset ( new T (x) );
-  e . best = std::numeric_limits<double>::infinity();
+  e . best = bound;
+  e . best_index = -1;
   return nearest ( e );
 }
 
@@ -465,7 +545,7 @@ search ( SearchException & e ) const {
       e . work_stack -> pop ();
       continue;
     }
-    double dist = getDistance ( * e . x, * it, e );
+    double dist = getDistance ( * e . x, * it, e, threshold ( e, it ) );
     double r = radius ( it );
 
     bool breakflag = false;
@@ -510,6 +590,7 @@ search ( SearchException & e ) const {
         AspirationException & ae = dynamic_cast<AspirationException&> ( e );
         if ( dist < ae . delta ) {
           ae . results -> push_back ( index ( it ) );
+          ae . distances -> push_back ( dist );
           ae . work_stack . reset ( new std::stack<int64_t> () ); 
           breakflag = true;
           break;
@@ -527,6 +608,7 @@ search ( SearchException & e ) const {
           if ( de . results -> empty () || 
                de . results -> back () != index ( it ) ) {
             de . results -> push_back ( index ( it ) );
+            de . distances -> push_back ( dist );
           }
         }
         if ( dist > de . delta + r ) { 
@@ -557,8 +639,10 @@ search ( SearchException & e ) const {
       e . work_stack -> push ( index ( L ) );
       continue;
     }
-    double ldist = getDistance ( * e . x, *L, e );
-    double rdist = getDistance ( * e . x, *R, e );
+    // A child is visited first if it is closer; lower bounds suffice to
+    // order children which will be pruned
+    double ldist = getDistance ( * e . x, *L, e, threshold ( e, L ) );
+    double rdist = getDistance ( * e . x, *R, e, threshold ( e, R ) );
     e . work_stack -> pop ();
     if ( ldist < rdist ) {
       e . work_stack -> push ( index ( R ) );
@@ -570,6 +654,28 @@ search ( SearchException & e ) const {
   }
 }
 
+template < class T, class D >
+double MetricTree<T,D>::
+threshold ( SearchException const& e, iterator it ) const {
+  double r = radius ( it );
+  switch ( e . type ) {
+    case 3: 
+      return dynamic_cast<NearestException const&> ( e ) . best + r;
+    case 4:
+    {
+      KNearestException const& kne = dynamic_cast<KNearestException const&> ( e );
+      if ( kne . best . size () < kne . k ) return std::numeric_limits<double>::infinity();
+      return kne . best . begin () -> first + r;
+    }
+    case 5: 
+      return dynamic_cast<AspirationException const&> ( e ) . delta + r;
+    case 6: 
+      return dynamic_cast<DeltaCloseException const&> ( e ) . delta + r;
+    default:
+      throw std::logic_error ( "MetricTree::threshold. Invalid search type.\n" );
+  }
+}
+
 template < class T, class D >
 double MetricTree<T,D>::
 radius ( iterator it ) const {
@@ -652,6 +758,26 @@ insertAsRight ( iterator n, T const& x ) {
   return node ( child_index );
 }
 
+template < class T, class D >
+void MetricTree<T,D>::
+restore ( std::vector<T> const& points,
+          std::vector<int64_t> const& left,
+          std::vector<int64_t> const& right,
+          std::vector<int64_t> const& parent,
+          std::vector<double> const& radius ) {
+  if ( left . size () != points . size () || 
+       right . size () != points . size () ||
+       parent . size () != points . size () ||
+       radius . size () != points . size () ) {
+    throw std::logic_error ( "MetricTree::restore. Inconsistent topology.\n" );
+  }
+  points_ = points;
+  left_ = left;
+  right_ = right;
+  parent_ = parent;
+  radius_ = radius;
+}
+
 template < class T, class D >
 void MetricTree<T,D>::
 graphVizDebug ( const char * filename ) {
@@ -675,9 +801,11 @@ class MetricTreeException {
 public:
   boost::shared_ptr<T> x;
   boost::shared_ptr<std::stack<std::pair<T, T> > > calculations;
+  boost::shared_ptr<std::stack<double> > bounds; // of calculations (see getDistance)
   int type;
   MetricTreeException ( void ) : type ( 0 )
-    { calculations . reset ( new std::stack<std::pair<T,T> >); }
+    { calculations . reset ( new std::stack<std::pair<T,T> >); 
+      bounds . reset ( new std::stack<double> ); }
   virtual ~MetricTreeException ( void ) {}
   virtual void raise ( void ) { throw *this; }
 };
@@ -698,10 +826,12 @@ public:
   using MetricTreeException<T,D>::type;
   boost::shared_ptr<std::stack<int64_t> > work_stack;
   boost::shared_ptr<std::vector<int64_t> > results;
+  boost::shared_ptr<std::vector<double> > distances; // of results from x
   SearchException ( void ) { 
     type = 2;
     work_stack . reset ( new std::stack<int64_t> ); 
     results . reset ( new std::vector<int64_t> ); 
+    distances . reset ( new std::vector<double> ); 
   }
   virtual ~SearchException ( void ) {}
   virtual void raise ( void ) { throw *this; }
@@ -753,3 +883,4 @@ public:
 
 }
 
+#endif
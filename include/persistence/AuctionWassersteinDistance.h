@@ -0,0 +1,382 @@
+/// AuctionWassersteinDistance.h
+///   This file provides the function "AuctionWassersteinDistance", which
+///   approximates the Wasserstein distance between two persistence
+///   diagrams within a given relative error by Bertsekas' auction
+///   algorithm with epsilon-scaling, as in Kerber, Morozov and Nigmetov,
+///   "Geometry helps to compare persistence diagrams" (2017).
+///   The matching problem is the one solved exactly by WassersteinDistance
+///   (the generators of each diagram and the diagonal points of the
+///   other), but costs are computed when needed rather than stored.
+///   A generator of the first diagram finds the items it values most
+///   with a kd-tree over the generators of the second diagram which
+///   keeps the smallest price in each subtree; the diagonal points,
+///   which are interchangeable, are kept ordered by price.
+///   After each auction the prices give a lower bound on the optimal
+///   cost; scaling stops once the cost of the assignment is within the
+///   relative error of that bound, so the error is guaranteed. If
+///   rounding keeps the prices from certifying the error (e.g. when the
+///   large deaths standing in for infinite ones dominate the costs),
+///   the distance is computed exactly by WassersteinDistance instead.
+///   Given a "bound", scaling stops as soon as the lower bound exceeds
+///   it, and the lower bound is returned (so a result above the bound
+///   is only known to be at most the distance); an assignment within
+///   the relative error is only returned if it costs at most the bound.
+
+#ifndef AUCTIONWASSERSTEINDISTANCE_H
+#define AUCTIONWASSERSTEINDISTANCE_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <utility>
+#include "persistence/PersistenceDiagram.h"
+#include "persistence/WassersteinDistance.h"
+
+double
+AuctionWassersteinDistance ( PersistenceDiagram const& diagram_1,
+                             PersistenceDiagram const& diagram_2,
+                             double p,
+                             double relative_error,
+                             double bound = std::numeric_limits<double>::infinity () );
+
+namespace AuctionWassersteinDistance_detail {
+
+/// Auction
+///   Bidders are the generators of the first diagram (0 <= i < n1) and
+///   diagonal points (n1 <= i < n1 + n2); items are the generators of the
+///   second diagram (0 <= j < n2) and diagonal points (n2 <= j < n1 + n2).
+///   A generator is matched to any diagonal point at the p-th power of its
+///   distance to the diagonal; diagonal points are matched to each other
+///   at no cost.
+class Auction {
+public:
+  Auction ( std::vector<Generator> const& generators_1,
+            std::vector<Generator> const& generators_2,
+            double p );
+
+  /// cost
+  ///   Return the cost of assigning item j to bidder i
+  double
+  cost ( int i, int j ) const;
+
+  /// maximum
+  ///   Return an upper bound on the cost of an edge of an optimal
+  ///   assignment (no edge costs more than matching both ends to
+  ///   the diagonal)
+  double
+  maximum ( void ) const;
+
+  /// run
+  ///   Assign every bidder an item, bidding with increment "epsilon"
+  ///   from the current prices
+  void
+  run ( double epsilon );
+
+  /// primal
+  ///   Return the cost of the assignment
+  double
+  primal ( void ) const;
+
+  /// dual
+  ///   Return the lower bound on the optimal cost given by the prices,
+  ///   less the rounding error of computing it
+  double
+  dual ( void ) const;
+
+private:
+  struct Box {
+    double min_birth, max_birth, min_death, max_death;
+  };
+  std::vector<Generator> const& g1_;
+  std::vector<Generator> const& g2_;
+  int n1_;
+  int n2_;
+  int N_;
+  double p_;
+  std::vector<double> diagonal_1_; // cost of matching to the diagonal
+  std::vector<double> diagonal_2_;
+  std::vector<double> prices_;
+  std::vector<int> item_;  // by bidder, -1 if unassigned
+  std::vector<int> owner_; // by item, -1 if unassigned
+  // kd-tree over the generators of the second diagram; the node of the
+  // positions [lo,hi) is (lo+hi)/2
+  std::vector<int> tree_;
+  std::vector<int> where_;
+  std::vector<Box> boxes_;
+  std::vector<double> min_prices_; // smallest price in the subtree
+  // Diagonal items by price, and generators of the second diagram by
+  // their value to a diagonal bidder (cost plus price)
+  std::set<std::pair<double, int> > diagonal_items_;
+  std::set<std::pair<double, int> > projected_items_;
+
+  double power ( double d ) const {
+    if ( p_ == 1.0 ) return d;
+    if ( p_ == 2.0 ) return d * d;
+    return std::pow ( d, p_ );
+  }
+  void build ( int lo, int hi, int depth );
+  void update ( int lo, int hi, int pos );
+  void search ( int lo, int hi, int i, int * best,
+                double * best_value, double * second_value ) const;
+  void offer ( int j, double value, int * best,
+               double * best_value, double * second_value ) const;
+  void bid ( int i, int * best, double * best_value, double * second_value ) const;
+  void raise ( int j, double amount );
+};
+
+inline Auction::
+Auction ( std::vector<Generator> const& generators_1,
+          std::vector<Generator> const& generators_2,
+          double p ) : g1_ ( generators_1 ), g2_ ( generators_2 ), p_ ( p ) {
+  Generator::Distance distance;
+  n1_ = g1_ . size ();
+  n2_ = g2_ . size ();
+  N_ = n1_ + n2_;
+  for ( Generator const& g : g1_ ) diagonal_1_ . push_back ( power ( distance . diagonal ( g ) ) );
+  for ( Generator const& g : g2_ ) diagonal_2_ . push_back ( power ( distance . diagonal ( g ) ) );
+  prices_ . assign ( N_, 0.0 );
+  item_ . assign ( N_, -1 );
+  owner_ . assign ( N_, -1 );
+  tree_ . resize ( n2_ );
+  for ( int j = 0; j < n2_; ++ j ) tree_ [ j ] = j;
+  boxes_ . resize ( n2_ );
+  min_prices_ . assign ( n2_, 0.0 );
+  build ( 0, n2_, 0 );
+  where_ . resize ( n2_ );
+  for ( int pos = 0; pos < n2_; ++ pos ) where_ [ tree_ [ pos ] ] = pos;
+  for ( int j = 0; j < n2_; ++ j ) projected_items_ . insert ( std::make_pair ( diagonal_2_ [ j ], j ) );
+  for ( int j = n2_; j < N_; ++ j ) diagonal_items_ . insert ( std::make_pair ( 0.0, j ) );
+}
+
+inline void Auction::
+build ( int lo, int hi, int depth ) {
+  if ( lo >= hi ) return;
+  int mid = ( lo + hi ) / 2;
+  std::vector<Generator> const& g2 = g2_;
+  if ( depth % 2 == 0 ) {
+    std::nth_element ( tree_ . begin () + lo, tree_ . begin () + mid, tree_ . begin () + hi,
+      [&] ( int a, int b ) { return g2 [ a ] . birth < g2 [ b ] . birth; } );
+  } else {
+    std::nth_element ( tree_ . begin () + lo, tree_ . begin () + mid, tree_ . begin () + hi,
+      [&] ( int a, int b ) { return g2 [ a ] . death < g2 [ b ] . death; } );
+  }
+  build ( lo, mid, depth + 1 );
+  build ( mid + 1, hi, depth + 1 );
+  Box & box = boxes_ [ mid ];
+  box . min_birth = box . max_birth = g2_ [ tree_ [ mid ] ] . birth;
+  box . min_death = box . max_death = g2_ [ tree_ [ mid ] ] . death;
+  for ( int side = 0; side < 2; ++ side ) {
+    int first = ( side == 0 ) ? lo : mid + 1;
+    int last = ( side == 0 ) ? mid : hi;
+    if ( first >= last ) continue;
+    Box const& c = boxes_ [ ( first + last ) / 2 ];
+    box . min_birth = std::min ( box . min_birth, c . min_birth );
+    box . max_birth = std::max ( box . max_birth, c . max_birth );
+    box . min_death = std::min ( box . min_death, c . min_death );
+    box . max_death = std::max ( box . max_death, c . max_death );
+  }
+}
+
+inline void Auction::
+update ( int lo, int hi, int pos ) {
+  int mid = ( lo + hi ) / 2;
+  if ( pos < mid ) update ( lo, mid, pos );
+  if ( pos > mid ) update ( mid + 1, hi, pos );
+  double result = prices_ [ tree_ [ mid ] ];
+  if ( lo < mid ) result = std::min ( result, min_prices_ [ ( lo + mid ) / 2 ] );
+  if ( mid + 1 < hi ) result = std::min ( result, min_prices_ [ ( mid + 1 + hi ) / 2 ] );
+  min_prices_ [ mid ] = result;
+}
+
+inline double Auction::
+cost ( int i, int j ) const {
+  if ( i < n1_ && j < n2_ ) {
+    double d = std::max ( std::abs ( g1_ [ i ] . birth - g2_ [ j ] . birth ),
+                          std::abs ( g1_ [ i ] . death - g2_ [ j ] . death ) );
+    return power ( d );
+  }
+  if ( i < n1_ ) return diagonal_1_ [ i ];
+  if ( j < n2_ ) return diagonal_2_ [ j ];
+  return 0.0;
+}
+
+inline double Auction::
+maximum ( void ) const {
+  double result = 0.0;
+  for ( double d : diagonal_1_ ) result = std::max ( result, d );
+  for ( double d : diagonal_2_ ) result = std::max ( result, d );
+  return std::pow ( 2.0, p_ ) * result;
+}
+
+inline void Auction::
+offer ( int j, double value, int * best,
+        double * best_value, double * second_value ) const {
+  if ( value < * best_value ) {
+    * second_value = * best_value;
+    * best_value = value;
+    * best = j;
+  } else if ( value < * second_value ) {
+    * second_value = value;
+  }
+}
+
+inline void Auction::
+search ( int lo, int hi, int i, int * best,
+         double * best_value, double * second_value ) const {
+  if ( lo >= hi ) return;
+  int mid = ( lo + hi ) / 2;
+  Box const& box = boxes_ [ mid ];
+  Generator const& x = g1_ [ i ];
+  double gap = std::max ( std::max ( box . min_birth - x . birth, x . birth - box . max_birth ),
+                          std::max ( box . min_death - x . death, x . death - box . max_death ) );
+  if ( power ( std::max ( gap, 0.0 ) ) + min_prices_ [ mid ] >= * second_value ) return;
+  int j = tree_ [ mid ];
+  offer ( j, cost ( i, j ) + prices_ [ j ], best, best_value, second_value );
+  search ( lo, mid, i, best, best_value, second_value );
+  search ( mid + 1, hi, i, best, best_value, second_value );
+}
+
+inline void Auction::
+bid ( int i, int * best, double * best_value, double * second_value ) const {
+  * best = -1;
+  * best_value = std::numeric_limits<double>::infinity ();
+  * second_value = std::numeric_limits<double>::infinity ();
+  // The two cheapest diagonal items
+  double diagonal = ( i < n1_ ) ? diagonal_1_ [ i ] : 0.0;
+  int count = 0;
+  for ( std::set<std::pair<double, int> >::const_iterator it = diagonal_items_ . begin ();
+        it != diagonal_items_ . end () && count < 2; ++ it, ++ count ) {
+    offer ( it -> second, diagonal + it -> first, best, best_value, second_value );
+  }
+  if ( i < n1_ ) {
+    search ( 0, n2_, i, best, best_value, second_value );
+  } else {
+    count = 0;
+    for ( std::set<std::pair<double, int> >::const_iterator it = projected_items_ . begin ();
+          it != projected_items_ . end () && count < 2; ++ it, ++ count ) {
+      offer ( it -> second, it -> first, best, best_value, second_value );
+    }
+  }
+}
+
+inline void Auction::
+raise ( int j, double amount ) {
+  if ( j < n2_ ) {
+    projected_items_ . erase ( std::make_pair ( diagonal_2_ [ j ] + prices_ [ j ], j ) );
+    prices_ [ j ] += amount;
+    projected_items_ . insert ( std::make_pair ( diagonal_2_ [ j ] + prices_ [ j ], j ) );
+    update ( 0, n2_, where_ [ j ] );
+  } else {
+    diagonal_items_ . erase ( std::make_pair ( prices_ [ j ], j ) );
+    prices_ [ j ] += amount;
+    diagonal_items_ . insert ( std::make_pair ( prices_ [ j ], j ) );
+  }
+}
+
+inline void Auction::
+run ( double epsilon ) {
+  item_ . assign ( N_, -1 );
+  owner_ . assign ( N_, -1 );
+  std::vector<int> unassigned;
+  for ( int i = N_ - 1; i >= 0; -- i ) unassigned . push_back ( i );
+  while ( not unassigned . empty () ) {
+    int i = unassigned . back ();
+    unassigned . pop_back ();
+    int best;
+    double best_value;
+    double second_value;
+    bid ( i, &best, &best_value, &second_value );
+    // Raise the price of the best item until it is only epsilon better
+    if ( std::isinf ( second_value ) ) second_value = best_value;
+    raise ( best, second_value - best_value + epsilon );
+    if ( owner_ [ best ] >= 0 ) {
+      item_ [ owner_ [ best ] ] = -1;
+      unassigned . push_back ( owner_ [ best ] );
+    }
+    owner_ [ best ] = i;
+    item_ [ i ] = best;
+  }
+}
+
+inline double Auction::
+primal ( void ) const {
+  double result = 0.0;
+  for ( int i = 0; i < N_; ++ i ) result += cost ( i, item_ [ i ] );
+  return result;
+}
+
+inline double Auction::
+dual ( void ) const {
+  // For any prices, sum_i min_j ( c_ij + p_j ) - sum_j p_j is at most
+  // the cost of any perfect assignment. The prices may be far larger
+  // than the costs, so the bound is lowered by the rounding error of
+  // the sums (at most 2N units in the last place of their magnitude,
+  // doubled for the rounding of each term)
+  double result = 0.0;
+  double magnitude = 0.0;
+  for ( int i = 0; i < N_; ++ i ) {
+    int best;
+    double best_value;
+    double second_value;
+    bid ( i, &best, &best_value, &second_value );
+    result += best_value;
+    magnitude += std::abs ( best_value );
+  }
+  for ( int j = 0; j < N_; ++ j ) {
+    result -= prices_ [ j ];
+    magnitude += std::abs ( prices_ [ j ] );
+  }
+  return result - 4.0 * N_ * std::numeric_limits<double>::epsilon () * magnitude;
+}
+
+} // namespace AuctionWassersteinDistance_detail
+
+inline double
+AuctionWassersteinDistance ( PersistenceDiagram const& diagram_1,
+                             PersistenceDiagram const& diagram_2,
+                             double p,
+                             double relative_error,
+                             double bound ) {
+  using namespace AuctionWassersteinDistance_detail;
+  std::vector<Generator> generators_1 ( diagram_1 . begin (), diagram_1 . end () );
+  std::vector<Generator> generators_2 ( diagram_2 . begin (), diagram_2 . end () );
+  if ( generators_1 . empty () && generators_2 . empty () ) return 0.0;
+  Auction auction ( generators_1, generators_2, p );
+  double maximum = auction . maximum ();
+  if ( maximum == 0.0 ) return 0.0;
+  // The distance is the p-th root of the cost, so the cost may exceed
+  // the lower bound by the factor ( 1 + relative_error ) ^ p
+  double factor = std::pow ( 1.0 + relative_error, p );
+  double epsilon = maximum / 4.0;
+  double smallest = maximum * std::numeric_limits<double>::epsilon ();
+  // Once the lower bound exceeds "bound" it is returned instead
+  if ( bound < 0.0 ) return 0.0;
+  double cost_bound = std::pow ( bound, p );
+  double cost;
+  while ( true ) {
+    auction . run ( epsilon );
+    cost = auction . primal ();
+    double lower = auction . dual ();
+    if ( lower > cost_bound ) {
+      cost = lower;
+      break;
+    }
+    // An assignment costing more than the bound may be above it only
+    // by the error, so the comparison is not decided yet
+    if ( cost <= factor * std::max ( lower, 0.0 ) && cost <= cost_bound ) break;
+    if ( epsilon < smallest ) return WassersteinDistance ( diagram_1, diagram_2, p, bound );
+    epsilon /= 5.0;
+  }
+  double distance;
+  if ( p == 1 ) distance = cost;
+  else if ( p == 2 ) distance = std::sqrt ( cost );
+  else distance = std::pow ( cost, 1.0 / p );
+  if ( cost > cost_bound && distance <= bound ) {
+    distance = std::nextafter ( bound, std::numeric_limits<double>::infinity () );
+  }
+  return distance;
+}
+
+#endif
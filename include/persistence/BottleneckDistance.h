@@ -8,211 +8,307 @@
 #define HOPKROFTKARPBOTTLENECKDISTANCE_H
 
 #include <vector>
-#include <queue>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include "persistence/PersistenceDiagram.h"
+#include "persistence/GeometricBottleneckDistance.h"
 
+/* If the distance exceeds "bound" the search may stop early and return
+   a lower bound on it which exceeds "bound" (a result at most "bound"
+   is the distance) */
 double 
 BottleneckDistance( PersistenceDiagram const& diagram_1, 
-                    PersistenceDiagram const& diagram_2 );
+                    PersistenceDiagram const& diagram_2,
+                    double bound = std::numeric_limits<double>::infinity() );
 
 
 namespace BottleneckDistance_detail {
 
-class Edge{
-public:
-  int vertex_1;
-  int vertex_2;
-  double weight;
-  Edge(int v1, int v2, double w ){ vertex_1 = v1; vertex_2 = v2; weight = w;}
-  bool operator<(const Edge& other) const { return weight < other.weight; }
-};
-
 struct BottleneckProblem {
 
   /* Generators for two persistence diagrams which are going to be compared */
   std::vector<Generator> Generators1;
   std::vector<Generator> Generators2;
-  /* Number of generators in Generator1 and Generator2 */
-  unsigned int  Max_Size;
-  /* Edges between all the nodes given by generators of the persistence diagrams */
-  std::vector<Edge> Edges;
-  /* Pairing between the vertices in the persistence diagrams
-   * -1 means the vertex is not paired to any other vertex it is paired to special vertex NIL
-   * non negative number is the index of the vertex to which the given vertex is paired*/
-  std::vector< int > Pair;
-  /*Connection matrix gives the edges between the vertexes in the first diagram and the second*/
-  std::vector< std::vector < int > > Connections;
-  /*Layers used in Hopcroft-Karp algorithm
-   * the layer information is required for a NIL (special) vertex and all vertices in Generators1
-   * Hence 0 slot is used for NIL and all the vertices in Generators1 are shifted by one. So to
-   * read layer of the vertex 0 we access the Layers[1] */
-  std::vector<int> Layers;
+  /* Number of generators in Generator1, Generators2 and both */
+  unsigned int Size1;
+  unsigned int Size2;
+  unsigned int Max_Size;
+  /* Vertices of the first side are the generators of the first diagram
+   * (0 .. Size1-1) and the diagonal points of the generators of the second
+   * (Size1 + j). Vertices of the second side are the generators of the second
+   * diagram (0 .. Size2-1) and the diagonal points of the first (Size2 + i).
+   * The edges of the first side vertices are stored in compressed rows
+   * (Targets and Weights from Offsets[v] to Offsets[v+1]), each row sorted by
+   * weight. The diagonal points are all connected to each other with weight 0;
+   * these edges are not stored. */
+  std::vector<unsigned int> Offsets;
+  std::vector<int> Targets;
+  std::vector<double> Weights;
+  /* End of each row for the current threshold */
+  std::vector<unsigned int> Ends;
+  /* The distinct edge weights, sorted */
+  std::vector<double> Lengths;
+  /* Pairing between the vertices, -1 means unpaired. The pairing found for
+   * one threshold is kept (less its edges above the next) for the next. */
+  std::vector<int> PairA;
+  std::vector<int> PairB;
+  std::vector<double> PairWeight;
+  unsigned int Matched;
+  /* Layers used in Hopcroft-Karp algorithm, -1 means not reached. A second
+   * side vertex is in the layer of the vertex it was reached from. */
+  std::vector<int> LayerA;
+  std::vector<int> LayerB;
+  /* Second side vertices visited by the depth first search in this phase */
+  std::vector<char> Used;
+  /* Next edge to try in each row during the depth first search */
+  std::vector<unsigned int> Next;
+  std::vector<int> Queue;
+  /* Diagonal points of the second side not yet reached, and those reached in each layer */
+  std::vector<int> Projections;
+  std::vector< std::vector<int> > LayerProjections;
 
   void PrepareEdges( void ){
     Generator::Distance distance;
-    /*Set the number of generators */
-    Max_Size = Generators1.size() + Generators2.size();
-    /*Clear edges */
-    Edges.clear();
-    /* Connect all diagonal points to each other */
-    for (unsigned int i = Generators1.size(); i < Max_Size; ++i)
-      for (unsigned int j = Max_Size + Generators2.size(); j < 2*Max_Size; ++j)
-        Edges.push_back(Edge(i, j, 0));
-    /* Edges between real points */
-    unsigned int i = 0;
-    for ( std::vector<Generator>::const_iterator cur1 = Generators1.begin(); 
-          cur1 != Generators1.end(); ++cur1 ) {
-      unsigned int j = Max_Size;
-      for ( std::vector<Generator>::const_iterator cur2 = Generators2.begin(); 
-            cur2 != Generators2.end(); ++cur2 ) {
-        Edges.push_back(Edge(i,j++, distance(*cur1, *cur2)));
+    Size1 = Generators1.size();
+    Size2 = Generators2.size();
+    Max_Size = Size1 + Size2;
+    Offsets.assign( Max_Size + 1, 0 );
+    Targets.clear();
+    Weights.clear();
+    std::vector< std::pair<double, int> > row;
+    for( unsigned int v = 0; v < Max_Size; ++v ){
+      row.clear();
+      if( v < Size1 ){
+        /* Edges between real points, and to the diagonal point of v */
+        for( unsigned int j = 0; j < Size2; ++j )
+          row.push_back( std::make_pair( distance( Generators1[ v ], Generators2[ j ] ), j ) );
+        row.push_back( std::make_pair( distance.diagonal( Generators1[ v ] ), Size2 + v ) );
+      } else {
+        /* Edge between a diagonal point and its real point */
+        row.push_back( std::make_pair( distance.diagonal( Generators2[ v - Size1 ] ), v - Size1 ) );
       }
-      ++i;
+      std::sort( row.begin(), row.end() );
+      for( unsigned int e = 0; e < row.size(); ++e ){
+        Weights.push_back( row[ e ].first );
+        Targets.push_back( row[ e ].second );
+      }
+      Offsets[ v + 1 ] = Targets.size();
     }
-    /* Edges between real points and their corresponding diagonal points */
-    i = 0;
-    for ( std::vector<Generator>::const_iterator cur1 = Generators1.begin(); 
-          cur1 != Generators1.end(); ++cur1, ++i)
-      Edges.push_back( Edge( i, Max_Size + Generators2.size() + i, distance . diagonal ( *cur1 ) ) );
-    i = Max_Size;
-    for ( std::vector<Generator>::const_iterator cur2 = Generators2.begin(); 
-          cur2 != Generators2.end(); ++cur2, ++i)
-      Edges.push_back( Edge( Generators1.size() + (i - Max_Size), i, distance . diagonal ( *cur2 ) ) );
-    std::sort(Edges.begin(), Edges.end());
+    Lengths = Weights;
+    Lengths.push_back( 0 );
+    std::sort( Lengths.begin(), Lengths.end() );
+    Lengths.erase( std::unique( Lengths.begin(), Lengths.end() ), Lengths.end() );
+    PairA.assign( Max_Size, -1 );
+    PairB.assign( Max_Size, -1 );
+    PairWeight.assign( Max_Size, 0 );
+    Matched = 0;
+    Ends.resize( Max_Size );
+    Next.resize( Max_Size );
   }
 
-
-  /* Depth first search used by Hopf-Karp algorithm */
-  bool DFS( int v ) {
-    if( v < 0 ) return true;
-    /* for every adjacent vertex u of v */
-    for( unsigned int i = 0; i < Connections[ v ].size(); ++i ){
-      int u = Connections[ v ][ i ];
-      if( Layers[ Pair[ u ] + 1 ] == Layers[ v + 1 ] + 1 ){
-        if( DFS( Pair[ u ] ) ){
-          Pair[ u ] = v;
-          Pair[ v ] = u;
-          return true;
-        }
+  /* Use the edges with weight at most threshold */
+  void SetThreshold( double threshold ){
+    for( unsigned int v = 0; v < Max_Size; ++v ){
+      Ends[ v ] = std::upper_bound( Weights.begin() + Offsets[ v ],
+                                    Weights.begin() + Offsets[ v + 1 ],
+                                    threshold ) - Weights.begin();
+      if( PairA[ v ] >= 0 && PairWeight[ v ] > threshold ){
+        PairB[ PairA[ v ] ] = -1;
+        PairA[ v ] = -1;
+        --Matched;
       }
     }
-    Layers[ v + 1 ] = -1;
-    return false;
   }
-  /* Breath first search used by Hopf-Karp algorithm */
-  bool BFS( void ){
-    std::queue< int > vertex_queue;
 
-    /* For every vertex v given by Generators1 */
+  /* Put the second side vertex u reached from layer k into that layer */
+  void Reach( int u, int k, int & limit ){
+    LayerB[ u ] = k;
+    if( u >= (int) Size2 ) LayerProjections[ k ].push_back( u );
+    if( PairB[ u ] < 0 ){
+      limit = k;
+    } else {
+      LayerA[ PairB[ u ] ] = k + 1;
+      Queue.push_back( PairB[ u ] );
+    }
+  }
+
+  /* Breath first search used by Hopf-Karp algorithm. Every second side
+   * vertex is reached once. Returns the first layer with an unpaired second
+   * side vertex, or -1 if there is none. */
+  int BFS( void ){
+    LayerA.assign( Max_Size, -1 );
+    LayerB.assign( Max_Size, -1 );
+    LayerProjections.clear();
+    Queue.clear();
     for( unsigned int v = 0; v < Max_Size; ++v ){
-      /* If its not paired to vertex in Generators2 */
-      if ( Pair[ v ] < 0 ){
-        /* Set its layer to 0 and put it in the queue */
-        Layers[ v + 1 ] = 0;
-        vertex_queue.push( v );
-      }
-      else{
-        /* Otherwise mark it as matched (set Layer to NILL)*/
-        Layers[ v + 1 ] = -1;
+      if( PairA[ v ] < 0 ){
+        LayerA[ v ] = 0;
+        Queue.push_back( v );
       }
     }
-    /* Set layer for NIL */
-    Layers[ 0 ] = -1;
-    /* Search the vertices in the queue */
-    while ( !vertex_queue.empty( ) ){
-      int v = vertex_queue.front();
-      vertex_queue.pop();
-      if( Layers[ v + 1 ] > Layers[ 0 ] ){
-      for( unsigned int i = 0; i < Connections[ v ].size(); ++i ){
-          int u = Connections[ v ][ i ];
-          /* Check if the vertex has an edge to the match vertex */
-          if( Layers[ Pair[ u ] + 1 ] < 0 ){
-            /* Set the layer of the vertex (it can be NILL) which is 
-               matched to the matched vertex u  */
-            Layers[ Pair[ u ] + 1 ] = Layers[ v + 1 ] + 1;
-            /* If the pairing vertex is not NIL add it into the queue */
-            if( Pair[ u ] != -1 ) vertex_queue.push( Pair[u] );
-          }
+    Projections.clear();
+    for( unsigned int u = Size2; u < Max_Size; ++u ) Projections.push_back( u );
+    int limit = -1;
+    for( unsigned int head = 0; head < Queue.size(); ++head ){
+      int v = Queue[ head ];
+      int k = LayerA[ v ];
+      if( limit >= 0 && k > limit ) break;
+      if( LayerProjections.size() <= (unsigned int) k ) LayerProjections.resize( k + 1 );
+      for( unsigned int e = Offsets[ v ]; e < Ends[ v ]; ++e )
+        if( LayerB[ Targets[ e ] ] < 0 ) Reach( Targets[ e ], k, limit );
+      /* A diagonal point reaches all the diagonal points not yet reached */
+      if( v >= (int) Size1 ){
+        while( !Projections.empty() ){
+          int u = Projections.back();
+          Projections.pop_back();
+          if( LayerB[ u ] < 0 ) Reach( u, k, limit );
         }
       }
     }
-    return (Layers[ 0 ] != -1);
+    return limit;
   }
-  /*Hopf-Karp algorithm to find maximal matching*/
-  void Hopcroft_Karp(unsigned int &matching ){
-    while( BFS() == true )
-      for( unsigned int vertex = 0; vertex < Max_Size; ++vertex ){
-        if( Pair[ vertex ] == -1){
-          if( DFS( vertex ) ){
-            ++matching;
+
+  /* A second side vertex which the depth first search may visit from layer k */
+  bool Usable( int u, int k, int limit ) const {
+    return LayerB[ u ] == k && !Used[ u ] && !( k == limit && PairB[ u ] >= 0 );
+  }
+
+  /* Iterative depth first search used by Hopf-Karp algorithm, for vertex
+   * disjoint shortest augmenting paths. Returns the number found. */
+  unsigned int DFS( int limit ){
+    Used.assign( Max_Size, 0 );
+    for( unsigned int v = 0; v < Max_Size; ++v ) Next[ v ] = Offsets[ v ];
+    unsigned int augmented = 0;
+    std::vector<int> path_a, path_b;
+    std::vector<double> path_weight;
+    for( unsigned int root = 0; root < Max_Size; ++root ){
+      if( PairA[ root ] >= 0 ) continue;
+      path_a.assign( 1, root );
+      path_b.clear();
+      path_weight.clear();
+      while( !path_a.empty() ){
+        int v = path_a.back();
+        int k = LayerA[ v ];
+        int u = -1;
+        double weight = 0;
+        if( k <= limit ){
+          while( Next[ v ] < Ends[ v ] ){
+            unsigned int e = Next[ v ]++;
+            if( Usable( Targets[ e ], k, limit ) ){
+              u = Targets[ e ];
+              weight = Weights[ e ];
+              break;
+            }
           }
+          if( u < 0 && v >= (int) Size1 ){
+            std::vector<int> & projections = LayerProjections[ k ];
+            while( !projections.empty() ){
+              if( Usable( projections.back(), k, limit ) ){
+                u = projections.back();
+                break;
+              }
+              projections.pop_back();
+            }
+          }
+        }
+        if( u < 0 ){
+          /* Dead end */
+          path_a.pop_back();
+          if( !path_b.empty() ){
+            path_b.pop_back();
+            path_weight.pop_back();
+          }
+          continue;
         }
+        Used[ u ] = 1;
+        path_b.push_back( u );
+        path_weight.push_back( weight );
+        if( PairB[ u ] < 0 ){
+          for( unsigned int i = 0; i < path_a.size(); ++i ){
+            PairA[ path_a[ i ] ] = path_b[ i ];
+            PairB[ path_b[ i ] ] = path_a[ i ];
+            PairWeight[ path_a[ i ] ] = path_weight[ i ];
+          }
+          ++augmented;
+          break;
+        }
+        path_a.push_back( PairB[ u ] );
       }
+    }
+    return augmented;
+  }
+
+  /* Hopf-Karp algorithm. Returns true if all vertices can be paired
+   * with edges of weight at most threshold. */
+  bool Feasible( double threshold ){
+    SetThreshold( threshold );
+    while( Matched < Max_Size ){
+      int limit = BFS();
+      if( limit < 0 ) break;
+      Matched += DFS( limit );
+    }
+    return Matched == Max_Size;
   }
 
 };
 
+/* Diagrams with at least this many generators in total are compared by
+   GeometricBottleneckDistance, which does not build all the edges */
+const unsigned int geometric_size = 64;
+
+/* The geometric search needs finite coordinates */
+inline bool Finite( PersistenceDiagram const& diagram ){
+  for ( PersistenceDiagram::const_iterator it = diagram.begin(); it != diagram.end(); ++it )
+    if ( not std::isfinite( it -> birth ) || not std::isfinite( it -> death ) ) return false;
+  return true;
+}
+
+/* The bottleneck distance by the Hopcroft-Karp algorithm on all the edges
+   (see BottleneckDistance for "bound") */
+inline double
+MatchingBottleneckDistance( PersistenceDiagram const& diagram_1, 
+                            PersistenceDiagram const& diagram_2,
+                            double bound ) {
+  if( diagram_1.size() == 0 && diagram_2.size() == 0 ) return 0;
+  BottleneckProblem bp;
+  bp.Generators1.assign( diagram_1.begin(), diagram_1.end() );
+  bp.Generators2.assign( diagram_2.begin(), diagram_2.end() );
+  bp.PrepareEdges();
+  /* Binary search for the smallest weight with a perfect matching.
+   * All vertices can be paired with all the edges. */
+  std::vector<double> const& Lengths = bp.Lengths;
+  unsigned int first = 0;
+  unsigned int last = Lengths.size() - 1;
+  /* A matching at the largest length at most the bound decides the
+   * comparison first: if there is none (a maximum matching which is not
+   * perfect certifies it), the distance is at least the next length */
+  if( bound < Lengths[ last ] ){
+    unsigned int below = std::upper_bound( Lengths.begin(), Lengths.end(), bound ) - Lengths.begin();
+    if( below == 0 ) return Lengths[ 0 ];
+    if( not bp.Feasible( Lengths[ below - 1 ] ) ) return Lengths[ below ];
+    last = below - 1;
+  }
+  while( first < last ){
+    unsigned int mid = ( first + last ) / 2;
+    if( bp.Feasible( Lengths[ mid ] ) ) last = mid; else first = mid + 1;
+  }
+  return Lengths[ first ];
+}
+
 } //namespace
 
 inline double 
 BottleneckDistance( PersistenceDiagram const& diagram_1, 
-                    PersistenceDiagram const& diagram_2 ) {
+                    PersistenceDiagram const& diagram_2,
+                    double bound ) {
   using namespace BottleneckDistance_detail;
-  BottleneckProblem bp;
-  std::vector<int> & Pair = bp.Pair;
-  std::vector<int> & Layers = bp.Layers;
-  std::vector< std::vector < int > > & Connections = bp.Connections;
-  std::vector<Generator> & Generators1 = bp . Generators1;
-  std::vector<Generator> & Generators2 = bp . Generators2;
-  unsigned int & Max_Size = bp . Max_Size;
-  std::vector<Edge> & Edges = bp . Edges;
-  Generators1 . assign ( diagram_1 . begin (), diagram_1 . end () );
-  Generators2 . assign ( diagram_2 . begin (), diagram_2 . end () );
   /* If both diagrams are empty the distance is 0 */
-  if( Generators1.size() == 0 &&  Generators2.size() == 0 ) return 0;
-  bp.PrepareEdges ();
-
-  /* Clear the pairing */
-  Pair.clear( );
-  Pair.assign( 2*Max_Size, -1);
-  /* Clearing Layers */
-  Layers.clear();
-  Layers.resize( Max_Size + 1 );
-  /* No vertices are matched */
-  unsigned int matching = 0;
-  /* Clear the connection matrix and set it to the right size */
-  Connections.clear();
-  Connections.resize( Max_Size );
-  /* The maximal weight of the edges which are used for the matching */
-  double current_weight = 0;
-  /* First non added edge is an iterator pointing to the first edge 
-     in Edges which was added to the Connections */
-  unsigned int first_not_added_edge = 0;
-  /* Repeat till all the vertices are matched */
-  while( matching < Max_Size){
-    /* Add the edges with the current weight (distance) to the connection matrix */
-    while ( Edges[ first_not_added_edge ].weight == current_weight && 
-            first_not_added_edge < Edges.size()){
-      /*Add the edge to Connections*/
-      Connections[ Edges[ first_not_added_edge ].vertex_1 ].
-        push_back( Edges[ first_not_added_edge ].vertex_2);
-      ++first_not_added_edge;
-    }
-    /* Do matching */
-    bp.Hopcroft_Karp( matching );
-    if( matching == Max_Size ){          
-      return current_weight;
-    }
-    /* Check if we did not run out of edges. This should never happen. */
-    if( first_not_added_edge == Edges.size() ){
-      std::cout << "Serious problem - Not enough edges to find the matching! \n";
-      return -1;
-    }
-    /* Increase the value of the current weight */
-    current_weight = Edges[ first_not_added_edge ].weight;
-  }
-  return -1;
+  if( diagram_1.size() == 0 && diagram_2.size() == 0 ) return 0;
+  if( diagram_1.size() + diagram_2.size() >= geometric_size &&
+      Finite( diagram_1 ) && Finite( diagram_2 ) )
+    return GeometricBottleneckDistance( diagram_1, diagram_2, bound );
+  return MatchingBottleneckDistance( diagram_1, diagram_2, bound );
 }
 
 #endif
@@ -0,0 +1,549 @@
+/// GeometricBottleneckDistance.h
+///   This file provides the function "GeometricBottleneckDistance",
+///   which computes the bottleneck distance between two persistence
+///   diagrams without building the complete bipartite graph of
+///   generators. Whether a perfect matching with edges of length at
+///   most r exists is decided by the Hopcroft-Karp algorithm, where the
+///   neighbors of a vertex are found with a kd-tree (in the L-infinity
+///   plane) from which visited vertices are deleted, as in Efrat, Itai
+///   and Katz, "Geometry helps in bottleneck matching and related
+///   problems" (2001). The distance is found by bisection on r, and
+///   then by binary search among the (few) candidate edge lengths
+///   left in the final interval. Memory is linear in the diagram sizes.
+
+#ifndef GEOMETRICBOTTLENECKDISTANCE_H
+#define GEOMETRICBOTTLENECKDISTANCE_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "persistence/PersistenceDiagram.h"
+
+/// GeometricBottleneckDistance
+///   If the distance exceeds "bound" the search may stop early and 
+///   return a lower bound on it which exceeds "bound" (a result at most
+///   "bound" is the distance)
+double
+GeometricBottleneckDistance ( PersistenceDiagram const& diagram_1,
+                              PersistenceDiagram const& diagram_2,
+                              double bound = std::numeric_limits<double>::infinity () );
+
+namespace GeometricBottleneckDistance_detail {
+
+/// distance
+///   L-infinity distance between generators (as Generator::Distance)
+inline double
+distance ( Generator const& x, Generator const& y ) {
+  return std::max ( std::abs ( x . birth - y . birth ),
+                    std::abs ( x . death - y . death ) );
+}
+
+/// PointSet
+///   A kd-tree over some of a vector of generators, supporting
+///   deletion and the L-infinity queries "find a point within r",
+///   "count the points within r" and "report the distances in
+///   (lo, hi]". Points are referred to by their position in the tree.
+class PointSet {
+public:
+  /// assign
+  ///   Build the tree over "points [ id ]" for the given ids.
+  ///   Set where [ id ] to the position of each.
+  void
+  assign ( std::vector<Generator> const& points,
+           std::vector<int> const& ids,
+           std::vector<int> * where );
+
+  /// reset
+  ///   Undo all deletions
+  void
+  reset ( void );
+
+  /// find
+  ///   Return the position of a point within "r" of "x" which has
+  ///   not been deleted, or -1 if there is none
+  int
+  find ( Generator const& x, double r ) const;
+
+  /// erase
+  ///   Delete the point at position "pos"
+  void
+  erase ( int pos );
+
+  /// id
+  ///   Return the id of the point at position "pos"
+  int
+  id ( int pos ) const { return ids_ [ pos ]; }
+
+  /// count
+  ///   Return the number of points within "r" of "x" (including
+  ///   deleted points)
+  int64_t
+  count ( Generator const& x, double r ) const;
+
+  /// report
+  ///   Append the distances from "x" in (lo, hi] to "out"
+  void
+  report ( Generator const& x, double lo, double hi,
+           std::vector<double> * out ) const;
+
+private:
+  struct Box {
+    double min_birth, max_birth, min_death, max_death;
+  };
+  std::vector<Generator> const* points_;
+  std::vector<int> ids_; // in tree order; the node of [lo,hi) is (lo+hi)/2
+  std::vector<int> alive_; // number of points in the subtree not deleted
+  std::vector<char> deleted_;
+  std::vector<Box> boxes_; // bounding box of the subtree
+
+  Generator const& point ( int pos ) const { return (*points_) [ ids_ [ pos ] ]; }
+  void build ( int lo, int hi, int depth );
+  void fill ( int lo, int hi );
+  // Smallest and largest distance from x to a point of the box. Floating
+  // point subtraction is monotone, so these bound the computed distances.
+  static double gap ( Box const& b, Generator const& x ) {
+    return std::max ( std::max ( b . min_birth - x . birth, x . birth - b . max_birth ),
+                      std::max ( b . min_death - x . death, x . death - b . max_death ) );
+  }
+  static double span ( Box const& b, Generator const& x ) {
+    return std::max ( std::max ( std::abs ( b . min_birth - x . birth ),
+                                 std::abs ( b . max_birth - x . birth ) ),
+                      std::max ( std::abs ( b . min_death - x . death ),
+                                 std::abs ( b . max_death - x . death ) ) );
+  }
+  int find ( int lo, int hi, Generator const& x, double r ) const;
+  int64_t count ( int lo, int hi, Generator const& x, double r ) const;
+  void report ( int lo, int hi, Generator const& x, double l, double h,
+                std::vector<double> * out ) const;
+};
+
+inline void PointSet::
+assign ( std::vector<Generator> const& points,
+         std::vector<int> const& ids,
+         std::vector<int> * where ) {
+  points_ = &points;
+  ids_ = ids;
+  boxes_ . resize ( ids_ . size () );
+  build ( 0, ids_ . size (), 0 );
+  for ( int pos = 0; pos < ids_ . size (); ++ pos ) (*where) [ ids_ [ pos ] ] = pos;
+  reset ();
+}
+
+inline void PointSet::
+build ( int lo, int hi, int depth ) {
+  if ( lo >= hi ) return;
+  int mid = ( lo + hi ) / 2;
+  std::vector<Generator> const& points = *points_;
+  if ( depth % 2 == 0 ) {
+    std::nth_element ( ids_ . begin () + lo, ids_ . begin () + mid, ids_ . begin () + hi,
+      [&] ( int a, int b ) { return points [ a ] . birth < points [ b ] . birth; } );
+  } else {
+    std::nth_element ( ids_ . begin () + lo, ids_ . begin () + mid, ids_ . begin () + hi,
+      [&] ( int a, int b ) { return points [ a ] . death < points [ b ] . death; } );
+  }
+  build ( lo, mid, depth + 1 );
+  build ( mid + 1, hi, depth + 1 );
+  Box & box = boxes_ [ mid ];
+  box . min_birth = box . max_birth = point ( mid ) . birth;
+  box . min_death = box . max_death = point ( mid ) . death;
+  for ( int side = 0; side < 2; ++ side ) {
+    int first = ( side == 0 ) ? lo : mid + 1;
+    int last = ( side == 0 ) ? mid : hi;
+    if ( first >= last ) continue;
+    Box const& c = boxes_ [ ( first + last ) / 2 ];
+    box . min_birth = std::min ( box . min_birth, c . min_birth );
+    box . max_birth = std::max ( box . max_birth, c . max_birth );
+    box . min_death = std::min ( box . min_death, c . min_death );
+    box . max_death = std::max ( box . max_death, c . max_death );
+  }
+}
+
+inline void PointSet::
+reset ( void ) {
+  deleted_ . assign ( ids_ . size (), 0 );
+  alive_ . resize ( ids_ . size () );
+  fill ( 0, ids_ . size () );
+}
+
+inline void PointSet::
+fill ( int lo, int hi ) {
+  if ( lo >= hi ) return;
+  int mid = ( lo + hi ) / 2;
+  alive_ [ mid ] = hi - lo;
+  fill ( lo, mid );
+  fill ( mid + 1, hi );
+}
+
+inline void PointSet::
+erase ( int pos ) {
+  int lo = 0;
+  int hi = ids_ . size ();
+  while ( lo < hi ) {
+    int mid = ( lo + hi ) / 2;
+    -- alive_ [ mid ];
+    if ( pos == mid ) {
+      deleted_ [ pos ] = 1;
+      return;
+    }
+    if ( pos < mid ) hi = mid; else lo = mid + 1;
+  }
+}
+
+inline int PointSet::
+find ( Generator const& x, double r ) const {
+  return find ( 0, ids_ . size (), x, r );
+}
+
+inline int PointSet::
+find ( int lo, int hi, Generator const& x, double r ) const {
+  if ( lo >= hi ) return -1;
+  int mid = ( lo + hi ) / 2;
+  if ( alive_ [ mid ] == 0 || gap ( boxes_ [ mid ], x ) > r ) return -1;
+  if ( not deleted_ [ mid ] && distance ( point ( mid ), x ) <= r ) return mid;
+  int result = find ( lo, mid, x, r );
+  if ( result >= 0 ) return result;
+  return find ( mid + 1, hi, x, r );
+}
+
+inline int64_t PointSet::
+count ( Generator const& x, double r ) const {
+  return count ( 0, ids_ . size (), x, r );
+}
+
+inline int64_t PointSet::
+count ( int lo, int hi, Generator const& x, double r ) const {
+  if ( lo >= hi ) return 0;
+  int mid = ( lo + hi ) / 2;
+  if ( gap ( boxes_ [ mid ], x ) > r ) return 0;
+  if ( span ( boxes_ [ mid ], x ) <= r ) return hi - lo;
+  return ( distance ( point ( mid ), x ) <= r ? 1 : 0 ) +
+         count ( lo, mid, x, r ) + count ( mid + 1, hi, x, r );
+}
+
+inline void PointSet::
+report ( Generator const& x, double lo, double hi,
+         std::vector<double> * out ) const {
+  report ( 0, ids_ . size (), x, lo, hi, out );
+}
+
+inline void PointSet::
+report ( int lo, int hi, Generator const& x, double l, double h,
+         std::vector<double> * out ) const {
+  if ( lo >= hi ) return;
+  int mid = ( lo + hi ) / 2;
+  if ( gap ( boxes_ [ mid ], x ) > h || span ( boxes_ [ mid ], x ) <= l ) return;
+  double d = distance ( point ( mid ), x );
+  if ( l < d && d <= h ) out -> push_back ( d );
+  report ( lo, mid, x, l, h, out );
+  report ( mid + 1, hi, x, l, h, out );
+}
+
+/// BottleneckMatcher
+///   The bipartite graph of the bottleneck problem, with edges no
+///   longer than a threshold r. The left vertices are the generators
+///   of the first diagram, 0 <= a < n1, followed by the diagonal
+///   projections of the second, n1 + j. The right vertices are the
+///   generators of the second diagram, 0 <= b < n2, followed by the
+///   diagonal projections of the first, n2 + i. A generator is joined
+///   to every generator of the other diagram and to its own projection;
+///   projections are joined to each other with length 0.
+///   The matching found for one threshold is kept (less its edges
+///   longer than the next threshold) as the start for the next.
+class BottleneckMatcher {
+public:
+  BottleneckMatcher ( std::vector<Generator> const& generators_1,
+                      std::vector<Generator> const& generators_2 );
+
+  /// feasible
+  ///   Return true if there is a perfect matching with edges of
+  ///   length at most "r"
+  bool
+  feasible ( double r );
+
+  /// upper
+  ///   Return a feasible threshold (every generator to the diagonal)
+  double
+  upper ( void ) const;
+
+  /// count
+  ///   Return the number of edges with lengths in (lo, hi]
+  ///   (not counting the edges between projections, of length 0)
+  int64_t
+  count ( double lo, double hi ) const;
+
+  /// candidates
+  ///   Return the distinct edge lengths in (lo, hi], sorted
+  std::vector<double>
+  candidates ( double lo, double hi ) const;
+
+private:
+  std::vector<Generator> const& g1_;
+  std::vector<Generator> const& g2_;
+  int n1_;
+  int n2_;
+  int N_;
+  std::vector<double> diagonal_1_;
+  std::vector<double> diagonal_2_;
+  std::vector<int> mate_a_;
+  std::vector<int> mate_b_;
+  int matched_;
+  // Search state
+  PointSet all_; // generators of the second diagram
+  std::vector<int> where_all_;
+  std::vector<PointSet> layer_sets_;
+  std::vector<std::vector<int> > layer_projections_;
+  std::vector<int> where_layer_;
+  std::vector<int> layer_a_;
+  std::vector<int> layer_b_;
+  std::vector<char> visited_b_;
+  std::vector<char> used_b_;
+  std::vector<std::vector<int> > layers_; // right vertices by layer
+  std::vector<int> queue_;
+  std::vector<int> projections_;
+
+  double length ( int a, int b ) const;
+  int phase ( double r );
+  template < class Alive > int
+  neighbor ( int a, double r, PointSet const& set,
+             std::vector<int> * projections, Alive const& alive ) const;
+};
+
+inline BottleneckMatcher::
+BottleneckMatcher ( std::vector<Generator> const& generators_1,
+                    std::vector<Generator> const& generators_2 )
+  : g1_ ( generators_1 ), g2_ ( generators_2 ) {
+  n1_ = g1_ . size ();
+  n2_ = g2_ . size ();
+  N_ = n1_ + n2_;
+  for ( Generator const& g : g1_ ) diagonal_1_ . push_back ( ( g . death - g . birth ) / 2.0 );
+  for ( Generator const& g : g2_ ) diagonal_2_ . push_back ( ( g . death - g . birth ) / 2.0 );
+  mate_a_ . assign ( N_, -1 );
+  mate_b_ . assign ( N_, -1 );
+  matched_ = 0;
+  std::vector<int> ids ( n2_ );
+  for ( int j = 0; j < n2_; ++ j ) ids [ j ] = j;
+  where_all_ . resize ( n2_ );
+  where_layer_ . resize ( n2_ );
+  all_ . assign ( g2_, ids, &where_all_ );
+}
+
+inline double BottleneckMatcher::
+length ( int a, int b ) const {
+  if ( a < n1_ && b < n2_ ) return distance ( g1_ [ a ], g2_ [ b ] );
+  if ( a < n1_ ) return ( b - n2_ == a ) ? diagonal_1_ [ a ]
+                                         : std::numeric_limits<double>::infinity ();
+  if ( b < n2_ ) return ( a - n1_ == b ) ? diagonal_2_ [ b ]
+                                         : std::numeric_limits<double>::infinity ();
+  return 0.0;
+}
+
+inline double BottleneckMatcher::
+upper ( void ) const {
+  double result = 0.0;
+  for ( double d : diagonal_1_ ) result = std::max ( result, d );
+  for ( double d : diagonal_2_ ) result = std::max ( result, d );
+  return result;
+}
+
+inline int64_t BottleneckMatcher::
+count ( double lo, double hi ) const {
+  int64_t result = 0;
+  for ( Generator const& g : g1_ ) result += all_ . count ( g, hi ) - all_ . count ( g, lo );
+  for ( double d : diagonal_1_ ) if ( lo < d && d <= hi ) ++ result;
+  for ( double d : diagonal_2_ ) if ( lo < d && d <= hi ) ++ result;
+  return result;
+}
+
+inline std::vector<double> BottleneckMatcher::
+candidates ( double lo, double hi ) const {
+  std::vector<double> result;
+  for ( Generator const& g : g1_ ) all_ . report ( g, lo, hi, &result );
+  for ( double d : diagonal_1_ ) if ( lo < d && d <= hi ) result . push_back ( d );
+  for ( double d : diagonal_2_ ) if ( lo < d && d <= hi ) result . push_back ( d );
+  if ( lo < 0.0 && 0.0 <= hi ) result . push_back ( 0.0 );
+  std::sort ( result . begin (), result . end () );
+  result . erase ( std::unique ( result . begin (), result . end () ), result . end () );
+  return result;
+}
+
+template < class Alive > int BottleneckMatcher::
+neighbor ( int a, double r, PointSet const& set,
+           std::vector<int> * projections, Alive const& alive ) const {
+  if ( a < n1_ ) {
+    int pos = set . find ( g1_ [ a ], r );
+    if ( pos >= 0 ) return set . id ( pos );
+    int b = n2_ + a;
+    if ( diagonal_1_ [ a ] <= r && alive ( b ) ) return b;
+  } else {
+    int b = a - n1_;
+    if ( diagonal_2_ [ b ] <= r && alive ( b ) ) return b;
+    // Projections are deleted lazily
+    while ( not projections -> empty () ) {
+      b = projections -> back ();
+      if ( alive ( b ) ) return b;
+      projections -> pop_back ();
+    }
+  }
+  return -1;
+}
+
+inline int BottleneckMatcher::
+phase ( double r ) {
+  // Breadth first search from the free left vertices, in layers, up to
+  // the first layer with a free right vertex
+  layer_a_ . assign ( N_, -1 );
+  layer_b_ . assign ( N_, -1 );
+  visited_b_ . assign ( N_, 0 );
+  layers_ . clear ();
+  queue_ . clear ();
+  for ( int a = 0; a < N_; ++ a ) {
+    if ( mate_a_ [ a ] == -1 ) {
+      layer_a_ [ a ] = 0;
+      queue_ . push_back ( a );
+    }
+  }
+  if ( queue_ . empty () ) return 0;
+  all_ . reset ();
+  projections_ . clear ();
+  for ( int b = n2_; b < N_; ++ b ) projections_ . push_back ( b );
+  auto unvisited = [&] ( int b ) { return not visited_b_ [ b ]; };
+  int limit = std::numeric_limits<int>::max ();
+  for ( int head = 0; head < queue_ . size (); ++ head ) {
+    int a = queue_ [ head ];
+    int k = layer_a_ [ a ];
+    if ( k > limit ) break;
+    while ( true ) {
+      int b = neighbor ( a, r, all_, &projections_, unvisited );
+      if ( b < 0 ) break;
+      visited_b_ [ b ] = 1;
+      if ( b < n2_ ) all_ . erase ( where_all_ [ b ] );
+      layer_b_ [ b ] = k;
+      if ( layers_ . size () <= k ) layers_ . resize ( k + 1 );
+      layers_ [ k ] . push_back ( b );
+      if ( mate_b_ [ b ] == -1 ) {
+        limit = k;
+      } else {
+        layer_a_ [ mate_b_ [ b ] ] = k + 1;
+        queue_ . push_back ( mate_b_ [ b ] );
+      }
+    }
+  }
+  if ( limit == std::numeric_limits<int>::max () ) return 0;
+  // Depth first search for vertex disjoint shortest augmenting paths,
+  // with a kd-tree per layer from which visited vertices are deleted
+  layer_sets_ . resize ( limit + 1 );
+  layer_projections_ . assign ( limit + 1, std::vector<int> () );
+  for ( int k = 0; k <= limit; ++ k ) {
+    std::vector<int> ids;
+    for ( int b : layers_ [ k ] ) {
+      if ( k == limit && mate_b_ [ b ] != -1 ) continue;
+      if ( b < n2_ ) ids . push_back ( b ); else layer_projections_ [ k ] . push_back ( b );
+    }
+    layer_sets_ [ k ] . assign ( g2_, ids, &where_layer_ );
+  }
+  used_b_ . assign ( N_, 0 );
+  int augmented = 0;
+  std::vector<int> path_a;
+  std::vector<int> path_b;
+  for ( int a0 = 0; a0 < N_; ++ a0 ) {
+    if ( mate_a_ [ a0 ] != -1 ) continue;
+    path_a . assign ( 1, a0 );
+    path_b . clear ();
+    while ( not path_a . empty () ) {
+      int a = path_a . back ();
+      int k = layer_a_ [ a ];
+      auto alive = [&] ( int b ) {
+        return layer_b_ [ b ] == k && not used_b_ [ b ] &&
+               not ( k == limit && mate_b_ [ b ] != -1 );
+      };
+      int b = ( k <= limit ) ? neighbor ( a, r, layer_sets_ [ k ],
+                                          &layer_projections_ [ k ], alive ) : -1;
+      if ( b < 0 ) {
+        path_a . pop_back ();
+        if ( not path_b . empty () ) path_b . pop_back ();
+        continue;
+      }
+      used_b_ [ b ] = 1;
+      if ( b < n2_ ) layer_sets_ [ k ] . erase ( where_layer_ [ b ] );
+      path_b . push_back ( b );
+      if ( mate_b_ [ b ] == -1 ) {
+        for ( int i = 0; i < path_a . size (); ++ i ) {
+          mate_a_ [ path_a [ i ] ] = path_b [ i ];
+          mate_b_ [ path_b [ i ] ] = path_a [ i ];
+        }
+        ++ augmented;
+        break;
+      }
+      path_a . push_back ( mate_b_ [ b ] );
+    }
+  }
+  return augmented;
+}
+
+inline bool BottleneckMatcher::
+feasible ( double r ) {
+  // Keep the edges of the previous matching which are short enough
+  for ( int a = 0; a < N_; ++ a ) {
+    int b = mate_a_ [ a ];
+    if ( b >= 0 && not ( length ( a, b ) <= r ) ) {
+      mate_a_ [ a ] = -1;
+      mate_b_ [ b ] = -1;
+      -- matched_;
+    }
+  }
+  while ( matched_ < N_ ) {
+    int augmented = phase ( r );
+    if ( augmented == 0 ) break;
+    matched_ += augmented;
+  }
+  return matched_ == N_;
+}
+
+} // namespace GeometricBottleneckDistance_detail
+
+inline double
+GeometricBottleneckDistance ( PersistenceDiagram const& diagram_1,
+                              PersistenceDiagram const& diagram_2,
+                              double bound ) {
+  using namespace GeometricBottleneckDistance_detail;
+  std::vector<Generator> generators_1 ( diagram_1 . begin (), diagram_1 . end () );
+  std::vector<Generator> generators_2 ( diagram_2 . begin (), diagram_2 . end () );
+  if ( generators_1 . empty () && generators_2 . empty () ) return 0.0;
+  BottleneckMatcher matcher ( generators_1, generators_2 );
+  // Bisect until few edge lengths are left in (lo, hi], where there is
+  // no perfect matching at lo and there is one at hi. Stop also when a
+  // step removes none of them (many edges of the same length).
+  double lo = -1.0;
+  double hi = matcher . upper ();
+  // The bound decides the comparison first: a maximum matching at the
+  // bound which is not perfect certifies that the distance exceeds it
+  if ( bound < 0.0 ) return 0.0;
+  if ( bound < hi ) {
+    if ( not matcher . feasible ( bound ) ) {
+      return std::nextafter ( bound, std::numeric_limits<double>::infinity () );
+    }
+    hi = bound;
+  }
+  int64_t few = 4 * ( generators_1 . size () + generators_2 . size () ) + 64;
+  int64_t left = matcher . count ( lo, hi );
+  while ( left > few ) {
+    double mid = ( lo < 0.0 ) ? hi / 2.0 : lo + ( hi - lo ) / 2.0;
+    if ( not ( lo < mid && mid < hi ) ) break;
+    if ( matcher . feasible ( mid ) ) hi = mid; else lo = mid;
+    int64_t count = matcher . count ( lo, hi );
+    if ( count == left ) break;
+    left = count;
+  }
+  // The distance is the length of one of the edges in (lo, hi]
+  std::vector<double> candidates = matcher . candidates ( lo, hi );
+  int64_t first = 0;
+  int64_t last = candidates . size () - 1;
+  while ( first < last ) {
+    int64_t mid = ( first + last ) / 2;
+    if ( matcher . feasible ( candidates [ mid ] ) ) last = mid; else first = mid + 1;
+  }
+  return candidates [ first ];
+}
+
+#endif
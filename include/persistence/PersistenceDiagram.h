@@ -17,7 +17,7 @@
 #include "boost/functional/hash.hpp"
 
 #include "boost/serialization/serialization.hpp"
-#include <boost/serialization/base_object.hpp>
+#include <boost/serialization/split_member.hpp>
 #include <boost/serialization/vector.hpp>
 
 int64_t generator_distance_count = 0;
@@ -65,20 +65,16 @@ struct Generator {
   }
 };
 
-class PersistenceDiagram : private std::vector<Generator> {
+/// PersistenceDiagram
+///   A list of generators. It either owns its generators or is a 
+///   read-only view of generators held elsewhere (e.g. in a memory 
+///   mapped PersistenceDiagramStore, which must outlive it). A view is
+///   copied into owned storage before it is modified.
+class PersistenceDiagram {
 public:
-  typedef std::vector<Generator> Base;
-  using Base::value_type;
-  using Base::assign;
-  using Base::begin;
-  using Base::end;
-  using Base::size;
-  using Base::empty;
-  using Base::clear;
-  using Base::push_back;
-  using Base::iterator;
-  using Base::const_iterator;
-  using Base::operator[];
+  typedef Generator value_type;
+  typedef Generator const* const_iterator;
+  typedef const_iterator iterator;
   void load ( std::string const& filename ) {
     clear ();
     std::ifstream infile ( filename );
@@ -100,25 +96,62 @@ public:
     // Replace -1's with something sensible
     double max_entry = 0;
     for ( int i = 0; i < size (); ++ i ) {
-      max_entry = std::max ( (*this)[i].birth, max_entry );
-      max_entry = std::max ( (*this)[i].death, max_entry );
+      max_entry = std::max ( storage_[i].birth, max_entry );
+      max_entry = std::max ( storage_[i].death, max_entry );
     }
     for ( int i = 0; i < size (); ++ i ) {
-      if ( (*this)[i].birth == -1.0 ) (*this)[i].birth = 100000.0;
-      if ( (*this)[i].death == -1.0 ) (*this)[i].death = 100000.0;
+      if ( storage_[i].birth == -1.0 ) storage_[i].birth = 100000.0;
+      if ( storage_[i].death == -1.0 ) storage_[i].death = 100000.0;
     }
     //std::cout << "Loaded a persistence diagram of size " << size () << "\n";
   }
-  PersistenceDiagram ( void ) {}
-  PersistenceDiagram ( std::string const& filename ) {
+  PersistenceDiagram ( void ) : view_ ( NULL ), view_size_ ( 0 ) {}
+  PersistenceDiagram ( std::string const& filename ) 
+    : view_ ( NULL ), view_size_ ( 0 ) {
     load ( filename );
   }
+  /// PersistenceDiagram (view)
+  ///   Construct a read-only view of "size" generators at "data"
+  PersistenceDiagram ( Generator const* data, uint64_t size ) 
+    : view_ ( data ), view_size_ ( size ) {}
+  const_iterator begin ( void ) const { 
+    return view_ ? view_ : storage_ . data (); 
+  }
+  const_iterator end ( void ) const { return begin () + size (); }
+  uint64_t size ( void ) const { 
+    return view_ ? view_size_ : storage_ . size (); 
+  }
+  bool empty ( void ) const { return size () == 0; }
+  Generator const& operator [] ( uint64_t i ) const { return begin () [ i ]; }
+  void clear ( void ) { view_ = NULL; view_size_ = 0; storage_ . clear (); }
+  void push_back ( Generator const& g ) { own (); storage_ . push_back ( g ); }
+  template < class InputIterator > void
+  assign ( InputIterator first, InputIterator last ) { 
+    clear (); 
+    storage_ . assign ( first, last ); 
+  }
+private:
+  std::vector<Generator> storage_;
+  Generator const* view_;
+  uint64_t view_size_;
+  void own ( void ) {
+    if ( view_ == NULL ) return;
+    storage_ . assign ( view_, view_ + view_size_ );
+    view_ = NULL;
+    view_size_ = 0;
+  }
   friend class boost::serialization::access; 
   template<class Archive>
-  void serialize (Archive & ar, const unsigned int version) {
-    ar & boost::serialization::base_object<std::vector<Generator> > (*this);
-   // for ( int i = 0; i < )
+  void save (Archive & ar, const unsigned int version) const {
+    std::vector<Generator> generators ( begin (), end () );
+    ar & generators;
+  }
+  template<class Archive>
+  void load (Archive & ar, const unsigned int version) {
+    clear ();
+    ar & storage_;
   }
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
 #endif
@@ -0,0 +1,194 @@
+/// PersistenceDiagramStore.h
+///   This file provides the class "PersistenceDiagramStore", a read-only
+///   collection of persistence diagrams packed into a single binary file
+///   which is memory mapped. Every process mapping the same file shares
+///   one copy of the diagrams in memory (the page cache), so processes
+///   on a node should use a node-local file, e.g. in /dev/shm.
+///   The first process to open a store builds it (from the text files
+///   the diagrams are loaded from) while holding a file lock; the others
+///   wait for it and then map it. A store is validated and mapped while
+///   holding the lock (shared), so it cannot be rebuilt in between. A store is rebuilt if the paths, or
+///   the size or modification time of any of the files, differ from
+///   those it was built from.
+///
+///   File format (native byte order):
+///     uint64_t magic, key, count;
+///     uint64_t offsets [ count + 1 ];  (in generators)
+///     Generator generators [ offsets [ count ] ];
+
+#ifndef PERSISTENCEDIAGRAMSTORE_H
+#define PERSISTENCEDIAGRAMSTORE_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "boost/functional/hash.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+#include "boost/interprocess/sync/file_lock.hpp"
+#include "boost/interprocess/sync/scoped_lock.hpp"
+#include "boost/interprocess/sync/sharable_lock.hpp"
+
+#include "persistence/PersistenceDiagram.h"
+
+class PersistenceDiagramStore {
+public:
+  /// PersistenceDiagramStore
+  ///   Open the store "filename" of the diagrams in the files "paths",
+  ///   building it first if it does not exist or was built from
+  ///   different paths or different versions of the files.
+  PersistenceDiagramStore ( std::string const& filename,
+                            std::vector<std::string> const& paths );
+
+  /// size
+  ///   Return the number of diagrams in the store
+  uint64_t
+  size ( void ) const;
+
+  /// diagram
+  ///   Return a view of diagram "i" (the diagram in paths [ i ]).
+  ///   It is valid for the lifetime of the store.
+  PersistenceDiagram
+  diagram ( uint64_t i ) const;
+
+private:
+  static const uint64_t magic_ = 0x5044535430303031ULL; // "PDST0001"
+  std::string filename_;
+  uint64_t key_;
+  boost::interprocess::file_mapping file_;
+  boost::interprocess::mapped_region region_;
+  uint64_t const* header_;
+  Generator const* generators_;
+
+  /// valid
+  ///   Return true if "filename_" is a complete store built from files
+  ///   with hash "key_" and "count" diagrams
+  bool
+  valid ( uint64_t count ) const;
+
+  /// build
+  ///   Load the diagrams in "paths" and write them to "filename_"
+  void
+  build ( std::vector<std::string> const& paths ) const;
+
+  /// map
+  ///   Map "filename_" and check that its header is that of a store
+  ///   built from files with hash "key_" and "count" diagrams
+  void
+  map ( uint64_t count );
+};
+
+inline PersistenceDiagramStore::
+PersistenceDiagramStore ( std::string const& filename,
+                          std::vector<std::string> const& paths )
+  : filename_ ( filename ), key_ ( 0 ) {
+  for ( std::string const& path : paths ) {
+    // The key identifies the version of each file by its size and
+    // modification time, so a store is not used after a file changes
+    struct stat info;
+    if ( stat ( path . c_str (), &info ) != 0 ) {
+      throw std::runtime_error ( "PersistenceDiagramStore. Cannot stat " + path );
+    }
+    boost::hash_combine ( key_, path );
+    boost::hash_combine ( key_, (uint64_t) info . st_size );
+    boost::hash_combine ( key_, (int64_t) info . st_mtim . tv_sec );
+    boost::hash_combine ( key_, (int64_t) info . st_mtim . tv_nsec );
+  }
+  std::string lockname = filename_ + ".lock";
+  { std::ofstream touch ( lockname, std::ios::app ); }
+  boost::interprocess::file_lock lock ( lockname . c_str () );
+  // A store being rebuilt (by a run on other files) is replaced under
+  // the exclusive lock; once mapped, it stays as it was
+  {
+    boost::interprocess::sharable_lock<boost::interprocess::file_lock> guard ( lock );
+    if ( valid ( paths . size () ) ) {
+      map ( paths . size () );
+      return;
+    }
+  }
+  boost::interprocess::scoped_lock<boost::interprocess::file_lock> guard ( lock );
+  // Another process may have built it while we waited
+  if ( not valid ( paths . size () ) ) build ( paths );
+  map ( paths . size () );
+}
+
+inline void PersistenceDiagramStore::
+map ( uint64_t count ) {
+  file_ = boost::interprocess::file_mapping ( filename_ . c_str (),
+                                              boost::interprocess::read_only );
+  region_ = boost::interprocess::mapped_region ( file_,
+                                                 boost::interprocess::read_only );
+  header_ = static_cast<uint64_t const*> ( region_ . get_address () );
+  if ( region_ . get_size () < 3 * sizeof ( uint64_t ) || header_ [ 0 ] != magic_ ||
+       header_ [ 1 ] != key_ || header_ [ 2 ] != count ) {
+    throw std::runtime_error ( "PersistenceDiagramStore. " + filename_ + 
+                               " changed while it was opened" );
+  }
+  generators_ = reinterpret_cast<Generator const*> ( header_ + 3 + size () + 1 );
+}
+
+inline uint64_t PersistenceDiagramStore::
+size ( void ) const {
+  return header_ [ 2 ];
+}
+
+inline PersistenceDiagram PersistenceDiagramStore::
+diagram ( uint64_t i ) const {
+  uint64_t const* offsets = header_ + 3;
+  return PersistenceDiagram ( generators_ + offsets [ i ],
+                              offsets [ i + 1 ] - offsets [ i ] );
+}
+
+inline bool PersistenceDiagramStore::
+valid ( uint64_t count ) const {
+  std::ifstream infile ( filename_, std::ios::binary );
+  if ( not infile ) return false;
+  uint64_t header [ 3 ];
+  infile . read ( (char *) header, sizeof ( header ) );
+  if ( not infile || header [ 0 ] != magic_ || header [ 1 ] != key_ ||
+       header [ 2 ] != count ) return false;
+  // Check the length, in case the file was truncated
+  std::vector<uint64_t> offsets ( count + 1 );
+  infile . read ( (char *) offsets . data (), offsets . size () * sizeof ( uint64_t ) );
+  if ( not infile ) return false;
+  infile . seekg ( 0, std::ios::end );
+  uint64_t expected = sizeof ( header ) + offsets . size () * sizeof ( uint64_t ) +
+                      offsets . back () * sizeof ( Generator );
+  return (uint64_t) infile . tellg () == expected;
+}
+
+inline void PersistenceDiagramStore::
+build ( std::vector<std::string> const& paths ) const {
+  std::vector<uint64_t> offsets ( 1, 0 );
+  std::vector<Generator> generators;
+  for ( std::string const& path : paths ) {
+    PersistenceDiagram pd ( path );
+    generators . insert ( generators . end (), pd . begin (), pd . end () );
+    offsets . push_back ( generators . size () );
+  }
+  uint64_t header [ 3 ] = { magic_, key_, paths . size () };
+  std::string tempname = filename_ + ".tmp";
+  {
+    std::ofstream outfile ( tempname, std::ios::binary );
+    if ( not outfile ) {
+      throw std::runtime_error ( "PersistenceDiagramStore::build. Cannot open " + tempname );
+    }
+    outfile . write ( (char const*) header, sizeof ( header ) );
+    outfile . write ( (char const*) offsets . data (),
+                      offsets . size () * sizeof ( uint64_t ) );
+    outfile . write ( (char const*) generators . data (),
+                      generators . size () * sizeof ( Generator ) );
+    if ( not outfile ) {
+      throw std::runtime_error ( "PersistenceDiagramStore::build. Cannot write " + tempname );
+    }
+  }
+  if ( std::rename ( tempname . c_str (), filename_ . c_str () ) != 0 ) {
+    throw std::runtime_error ( "PersistenceDiagramStore::build. Cannot replace " + filename_ );
+  }
+}
+
+#endif
@@ -4,12 +4,18 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <iostream>
 #include "PersistenceDiagram.h"
 
+// If the distance exceeds "bound" the solver may stop early and return
+// a lower bound on it which exceeds "bound" (a result at most "bound" is
+// the distance)
 double 
 WassersteinDistance( PersistenceDiagram const& diagram_1, 
                      PersistenceDiagram const& diagram_2,
-                     double p );
+                     double p,
+                     double bound = std::numeric_limits<double>::infinity() );
 
 
 namespace WassersteinDistance_detail {
@@ -139,22 +145,244 @@ namespace WassersteinDistance_detail {
     }
   };
 
-}
+// Shortest augmenting path method of Jonker and Volgenant, "A shortest
+// augmenting path algorithm for dense and sparse linear assignment
+// problems", Computing 38 (1987), following R. Jonker's lap.cpp.
+// Minimizes the cost directly. After column reduction, reduction transfer
+// and two rounds of augmenting row reduction, which assign most rows
+// cheaply, each remaining free row is assigned by a Dijkstra search over
+// reduced costs. Same interface as Hungarian.
+  class LAPJV {
+  public:
+    double const * cost_;
+    int n;
+    std::vector<int> rowsol, colsol; // column of each row, row of each column
+    std::vector<double> v;           // column dual variables
 
-inline double 
-WassersteinDistance( PersistenceDiagram const& diagram_1, 
-                     PersistenceDiagram const& diagram_2,
-                     double p ) {
-  using namespace WassersteinDistance_detail;
+    double cost ( int i, int j ) const {
+      return cost_ [ j + i * n ];
+    }
+
+    LAPJV ( int n_in, double const * cost_in ) : cost_ ( cost_in ), n ( n_in ) {
+      rowsol . assign ( n, -1 );
+      colsol . assign ( n, -1 );
+      v . assign ( n, 0.0 );
+    }
+
+    /* Returns the rows left unassigned */
+    std::vector<int> reduce ( void ) {
+      std::vector<int> matches ( n, 0 );
+      std::vector<int> free;
+      /* Column reduction */
+      for ( int j = n - 1; j >= 0; -- j ) {
+        double min = cost ( 0, j );
+        int imin = 0;
+        for ( int i = 1; i < n; ++ i ) {
+          if ( cost ( i, j ) < min ) { min = cost ( i, j ); imin = i; }
+        }
+        v [ j ] = min;
+        if ( ++ matches [ imin ] == 1 ) {
+          rowsol [ imin ] = j;
+          colsol [ j ] = imin;
+        } else if ( v [ j ] < v [ rowsol [ imin ] ] ) {
+          int j1 = rowsol [ imin ];
+          rowsol [ imin ] = j;
+          colsol [ j ] = imin;
+          colsol [ j1 ] = -1;
+        } else {
+          colsol [ j ] = -1;
+        }
+      }
+      /* Reduction transfer */
+      for ( int i = 0; i < n; ++ i ) {
+        if ( matches [ i ] == 0 ) {
+          free . push_back ( i );
+        } else if ( matches [ i ] == 1 ) {
+          int j1 = rowsol [ i ];
+          double min = std::numeric_limits<double>::infinity ();
+          for ( int j = 0; j < n; ++ j ) {
+            if ( j != j1 ) min = std::min ( min, cost ( i, j ) - v [ j ] );
+          }
+          if ( min < std::numeric_limits<double>::infinity () ) v [ j1 ] -= min;
+        }
+      }
+      /* Augmenting row reduction, twice. A row which loses its column is
+         reconsidered at once while the reduction is strict; the number of
+         reconsiderations is bounded, since with floating point costs the
+         reductions may become arbitrarily small. */
+      for ( int round = 0; round < 2 && n > 1; ++ round ) {
+        std::vector<int> previous;
+        previous . swap ( free );
+        int k = 0;
+        int64_t steps = 0;
+        while ( k < (int) previous . size () ) {
+          int i = previous [ k ++ ];
+          double umin = cost ( i, 0 ) - v [ 0 ];
+          int j1 = 0;
+          int j2 = -1;
+          double usubmin = std::numeric_limits<double>::infinity ();
+          for ( int j = 1; j < n; ++ j ) {
+            double h = cost ( i, j ) - v [ j ];
+            if ( h < usubmin ) {
+              if ( h >= umin ) {
+                usubmin = h;
+                j2 = j;
+              } else {
+                usubmin = umin;
+                umin = h;
+                j2 = j1;
+                j1 = j;
+              }
+            }
+          }
+          int i0 = colsol [ j1 ];
+          if ( umin < usubmin ) {
+            v [ j1 ] -= usubmin - umin;
+          } else if ( i0 > -1 ) {
+            j1 = j2;
+            i0 = colsol [ j2 ];
+          }
+          rowsol [ i ] = j1;
+          colsol [ j1 ] = i;
+          if ( i0 > -1 ) {
+            rowsol [ i0 ] = -1;
+            if ( umin < usubmin && ++ steps <= (int64_t) n * 16 ) previous [ -- k ] = i0;
+            else free . push_back ( i0 );
+          }
+        }
+      }
+      return free;
+    }
+
+    /* Assign the free row by a shortest augmenting path */
+    void augment ( int freerow ) {
+      std::vector<double> d ( n );
+      std::vector<int> pred ( n, freerow );
+      std::vector<int> collist ( n );
+      for ( int j = 0; j < n; ++ j ) {
+        d [ j ] = cost ( freerow, j ) - v [ j ];
+        collist [ j ] = j;
+      }
+      /* Columns collist[0..low) are scanned, collist[low..up) have the
+         current minimum distance and have not been scanned */
+      int low = 0;
+      int up = 0;
+      int last = 0;
+      int endofpath = -1;
+      double min = 0;
+      while ( endofpath < 0 ) {
+        if ( up == low ) {
+          last = low - 1;
+          min = d [ collist [ up ++ ] ];
+          for ( int k = up; k < n; ++ k ) {
+            int j = collist [ k ];
+            double h = d [ j ];
+            if ( h <= min ) {
+              if ( h < min ) { up = low; min = h; }
+              collist [ k ] = collist [ up ];
+              collist [ up ++ ] = j;
+            }
+          }
+          for ( int k = low; k < up; ++ k ) {
+            if ( colsol [ collist [ k ] ] < 0 ) { endofpath = collist [ k ]; break; }
+          }
+        }
+        if ( endofpath < 0 ) {
+          int j1 = collist [ low ++ ];
+          int i = colsol [ j1 ];
+          double h = cost ( i, j1 ) - v [ j1 ] - min;
+          for ( int k = up; k < n; ++ k ) {
+            int j = collist [ k ];
+            double v2 = cost ( i, j ) - v [ j ] - h;
+            if ( v2 < d [ j ] ) {
+              pred [ j ] = i;
+              if ( v2 == min ) {
+                if ( colsol [ j ] < 0 ) { endofpath = j; break; }
+                collist [ k ] = collist [ up ];
+                collist [ up ++ ] = j;
+              }
+              d [ j ] = v2;
+            }
+          }
+        }
+      }
+      /* Update the duals of the scanned columns */
+      for ( int k = 0; k <= last; ++ k ) {
+        int j1 = collist [ k ];
+        v [ j1 ] += d [ j1 ] - min;
+      }
+      /* Augment along the path */
+      int i;
+      do {
+        i = pred [ endofpath ];
+        colsol [ endofpath ] = i;
+        int j1 = endofpath;
+        endofpath = rowsol [ i ];
+        rowsol [ i ] = j1;
+      } while ( i != freerow );
+    }
+
+    /* A lower bound on the minimal cost from the column duals: the
+       row duals u_i = min_j ( c_ij - v_j ) are then feasible, and
+       sum u_i + sum v_j is at most the cost of any assignment. It is
+       reduced by the rounding error of the sums, which is relative to
+       the magnitude of the terms (the duals may be far larger than the
+       bound, e.g. for identical diagrams). */
+    double lower ( void ) const {
+      double result = 0;
+      double magnitude = 0;
+      for ( int i = 0; i < n; ++ i ) {
+        double u = std::numeric_limits<double>::infinity ();
+        int best = 0;
+        for ( int j = 0; j < n; ++ j ) {
+          double x = cost ( i, j ) - v [ j ];
+          if ( x < u ) { u = x; best = j; }
+        }
+        result += u;
+        magnitude += std::abs ( cost ( i, best ) ) + std::abs ( v [ best ] );
+      }
+      for ( int j = 0; j < n; ++ j ) {
+        result += v [ j ];
+        magnitude += std::abs ( v [ j ] );
+      }
+      return result - 1e-9 * std::abs ( result ) -
+             4.0 * n * std::numeric_limits<double>::epsilon () * magnitude;
+    }
+
+    /* If the minimal cost exceeds "bound", the search may stop early
+       and return a lower bound on it which exceeds "bound". The dual
+       bound is checked after the reduction and after 1, 2, 4, ...
+       augmentations, so checking costs at most a few augmentations. */
+    double getPrice ( double bound = std::numeric_limits<double>::infinity () ) {
+      if ( n == 0 ) return 0;
+      std::vector<int> free = reduce ();
+      bool bounded = bound < std::numeric_limits<double>::infinity ();
+      int check = 0;
+      for ( int f = 0; f < (int) free . size (); ++ f ) {
+        if ( bounded && f == check ) {
+          double result = lower ();
+          if ( result > bound ) return result;
+          check = 2 * check + 1;
+        }
+        augment ( free [ f ] );
+      }
+      double ret = 0;
+      for ( int x = 0; x < n; x++ ) ret += cost ( x, rowsol [ x ] );
+      return ret;
+    }
+  };
+
+/* The cost matrix of the matching problem between the generators of
+   diagram_1 and diagram_2 (with diagonal points added to each), row major:
+   the p-th powers of the distances */
+inline std::vector<double>
+CostMatrix ( PersistenceDiagram const& diagram_1, 
+             PersistenceDiagram const& diagram_2,
+             double p ) {
   Generator::Distance distance; 
-  // Distance matrix the generators in diagram_1 and diagram_2 
-  double* distanceMatrix;
   // Distance matrix has (diagram_1.size +  diagram_2.size())^2 elements 
   unsigned int matrixSize = diagram_1.size() + diagram_2.size();
-  // Allocate the matrix 
-  distanceMatrix = new double[matrixSize * matrixSize];
-  // If both persistence diagrams are empty than their distance is zero 
-  if ( !matrixSize ) return 0;
+  std::vector<double> distanceMatrix ( matrixSize * matrixSize );
   // Prepare distance matrix (if there is different number of generators, 
   // then we add extra rows (columns)
   //   with distance of the generator from the diagonal 
@@ -174,13 +402,35 @@ WassersteinDistance( PersistenceDiagram const& diagram_1,
       }
     }
   }
-  // Class with Munkres algorithm for computing minimal price of the matrix 
-  Hungarian munkres ( matrixSize, distanceMatrix );
-  double result = munkres . getPrice ();
-  delete[] distanceMatrix;
-  if( p == 1) return result;
-  if ( p == 2 ) return std::sqrt((double) ( result ));
-  return std::pow( result, 1.0 / p );
+  return distanceMatrix;
+}
+
+}
+
+inline double 
+WassersteinDistance( PersistenceDiagram const& diagram_1, 
+                     PersistenceDiagram const& diagram_2,
+                     double p,
+                     double bound ) {
+  using namespace WassersteinDistance_detail;
+  // If both persistence diagrams are empty than their distance is zero 
+  unsigned int matrixSize = diagram_1.size() + diagram_2.size();
+  if ( !matrixSize ) return 0;
+  if ( bound < 0 ) return 0;
+  std::vector<double> distanceMatrix = CostMatrix ( diagram_1, diagram_2, p );
+  // Jonker-Volgenant algorithm for computing minimal price of the matrix 
+  LAPJV solver ( matrixSize, distanceMatrix . data () );
+  double price_bound = std::pow ( bound, p );
+  double result = solver . getPrice ( price_bound );
+  double distance;
+  if( p == 1) distance = result;
+  else if ( p == 2 ) distance = std::sqrt((double) ( result ));
+  else distance = std::pow( result, 1.0 / p );
+  // A lower bound above the bound stays above it after rounding
+  if ( result > price_bound && distance <= bound ) {
+    distance = std::nextafter ( bound, std::numeric_limits<double>::infinity() );
+  }
+  return distance;
 }
 
 #endif
@@ -0,0 +1,160 @@
+/// DistanceStore.h
+///   This file provides the class "DistanceStore", a file of distances
+///   between points which persists across runs and is shared by the
+///   "Subsample" and "DistanceMatrix" programs. A point is identified
+///   by a hash of the contents of its diagrams (see Point::hash), not
+///   by its position in a sample file, so distances are reused by runs
+///   on different samples (or subsamples) of the same diagrams.
+///   The whole file is read when it is opened; new distances are
+///   appended by "flush" while holding a file lock, so several
+///   processes may share it.
+///
+///   File format (native byte order): a sequence of records
+///     uint64_t x, y;  (point hashes, x <= y)
+///     double p;       (the metric)
+///     double distance;
+///   A trailing partial record (from an interrupted write) is ignored.
+
+#ifndef DISTANCESTORE_H
+#define DISTANCESTORE_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <utility>
+#include <stdexcept>
+
+#include "boost/unordered_map.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/interprocess/sync/file_lock.hpp"
+#include "boost/interprocess/sync/scoped_lock.hpp"
+#include "boost/interprocess/sync/sharable_lock.hpp"
+
+class DistanceStore {
+public:
+  /// DistanceStore
+  ///   Open the store "filename" (created if it does not exist) and
+  ///   read the distances in it computed with metric "p"
+  DistanceStore ( std::string const& filename, double p );
+
+  /// find
+  ///   If the distance between the points with hashes "x" and "y" is
+  ///   stored, put it in "distance" and return true. Otherwise return false.
+  bool
+  find ( uint64_t x, uint64_t y, double * distance ) const;
+
+  /// insert
+  ///   Store the distance between the points with hashes "x" and "y".
+  ///   It is written to the file by the next "flush".
+  void
+  insert ( uint64_t x, uint64_t y, double distance );
+
+  /// flush
+  ///   Append the distances inserted since the last flush to the file
+  void
+  flush ( void );
+
+  /// size
+  ///   Return the number of stored distances
+  int64_t
+  size ( void ) const;
+
+private:
+  struct Record {
+    uint64_t x;
+    uint64_t y;
+    double p;
+    double distance;
+  };
+  std::string filename_;
+  std::string lockname_;
+  double p_;
+  boost::unordered_map<std::pair<uint64_t, uint64_t>, double> distances_;
+  std::vector<Record> pending_;
+  mutable boost::mutex mutex_;
+
+  static std::pair<uint64_t, uint64_t>
+  key ( uint64_t x, uint64_t y ) {
+    return ( x < y ) ? std::make_pair ( x, y ) : std::make_pair ( y, x );
+  }
+};
+
+inline DistanceStore::
+DistanceStore ( std::string const& filename, double p )
+  : filename_ ( filename ), lockname_ ( filename + ".lock" ), p_ ( p ) {
+  { std::ofstream touch ( filename_, std::ios::app | std::ios::binary ); }
+  { std::ofstream touch ( lockname_, std::ios::app ); }
+  boost::interprocess::file_lock lock ( lockname_ . c_str () );
+  boost::interprocess::sharable_lock<boost::interprocess::file_lock> guard ( lock );
+  std::ifstream infile ( filename_, std::ios::binary );
+  if ( not infile ) {
+    throw std::runtime_error ( "DistanceStore. Cannot open " + filename_ );
+  }
+  Record record;
+  while ( infile . read ( (char *) &record, sizeof ( Record ) ) ) {
+    // The metric is compared exactly, which also matches infinity
+    if ( record . p == p_ ) {
+      distances_ [ key ( record . x, record . y ) ] = record . distance;
+    }
+  }
+}
+
+inline bool DistanceStore::
+find ( uint64_t x, uint64_t y, double * distance ) const {
+  mutex_ . lock ();
+  boost::unordered_map<std::pair<uint64_t, uint64_t>, double>::const_iterator it =
+    distances_ . find ( key ( x, y ) );
+  bool found = ( it != distances_ . end () );
+  if ( found ) * distance = it -> second;
+  mutex_ . unlock ();
+  return found;
+}
+
+inline void DistanceStore::
+insert ( uint64_t x, uint64_t y, double distance ) {
+  mutex_ . lock ();
+  std::pair<uint64_t, uint64_t> k = key ( x, y );
+  if ( distances_ . insert ( std::make_pair ( k, distance ) ) . second ) {
+    Record record;
+    record . x = k . first;
+    record . y = k . second;
+    record . p = p_;
+    record . distance = distance;
+    pending_ . push_back ( record );
+  }
+  mutex_ . unlock ();
+}
+
+inline void DistanceStore::
+flush ( void ) {
+  mutex_ . lock ();
+  std::vector<Record> pending;
+  pending . swap ( pending_ );
+  mutex_ . unlock ();
+  if ( pending . empty () ) return;
+  boost::interprocess::file_lock lock ( lockname_ . c_str () );
+  boost::interprocess::scoped_lock<boost::interprocess::file_lock> guard ( lock );
+  std::fstream outfile ( filename_, std::ios::in | std::ios::out | std::ios::binary );
+  if ( not outfile ) {
+    throw std::runtime_error ( "DistanceStore::flush. Cannot open " + filename_ );
+  }
+  // Drop a partial record left by an interrupted write
+  outfile . seekp ( 0, std::ios::end );
+  int64_t length = outfile . tellp ();
+  outfile . seekp ( length - length % sizeof ( Record ) );
+  outfile . write ( (char const*) pending . data (),
+                    pending . size () * sizeof ( Record ) );
+  if ( not outfile ) {
+    throw std::runtime_error ( "DistanceStore::flush. Cannot write " + filename_ );
+  }
+}
+
+inline int64_t DistanceStore::
+size ( void ) const {
+  mutex_ . lock ();
+  int64_t result = distances_ . size ();
+  mutex_ . unlock ();
+  return result;
+}
+
+#endif
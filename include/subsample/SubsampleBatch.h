@@ -0,0 +1,82 @@
+/// SubsampleBatch.h
+///   This file provides the class "SubsampleBatch" which chooses how
+///   many distances to send to a worker in one job. A worker waits a
+///   full round trip (result sent, next job received) between jobs, so
+///   a job should hold enough distances to keep the worker busy for
+///   about that long. The round trip latency and the time per distance
+///   are measured from completed jobs.
+
+#ifndef SUBSAMPLEBATCH_H
+#define SUBSAMPLEBATCH_H
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+class SubsampleBatch {
+public:
+  /// SubsampleBatch
+  ///   Construct with a fixed batch size of 1
+  SubsampleBatch ( void );
+
+  /// assign
+  ///   Use batches of "size" distances, or if "size" is 0, adapt the
+  ///   size (between 1 and "maximum") to the measured latency
+  void
+  assign ( int64_t size, int64_t maximum );
+
+  /// record
+  ///   Record a job of "count" distances which took "seconds" to compute
+  ///   and "round_trip" seconds from being sent to its result being received
+  void
+  record ( int64_t count, double seconds, double round_trip );
+
+  /// size
+  ///   Return the number of distances to send in the next job
+  int64_t
+  size ( void ) const;
+
+private:
+  int64_t size_;
+  int64_t maximum_;
+  bool adaptive_;
+  double latency_; // moving average of the time a worker waits between jobs
+  double seconds_; // moving average of the time per distance
+  bool measured_;
+};
+
+inline SubsampleBatch::
+SubsampleBatch ( void ) : size_ ( 1 ), maximum_ ( 1 ), adaptive_ ( false ),
+  latency_ ( 0.0 ), seconds_ ( 0.0 ), measured_ ( false ) {}
+
+inline void SubsampleBatch::
+assign ( int64_t size, int64_t maximum ) {
+  adaptive_ = ( size == 0 );
+  size_ = adaptive_ ? 1 : size;
+  maximum_ = maximum;
+  measured_ = false;
+}
+
+inline void SubsampleBatch::
+record ( int64_t count, double seconds, double round_trip ) {
+  if ( not adaptive_ || count == 0 ) return;
+  double latency = std::max ( round_trip - seconds, 0.0 );
+  double per_distance = seconds / (double) count;
+  if ( not measured_ ) {
+    latency_ = latency;
+    seconds_ = per_distance;
+    measured_ = true;
+  } else {
+    latency_ = 0.9 * latency_ + 0.1 * latency;
+    seconds_ = 0.9 * seconds_ + 0.1 * per_distance;
+  }
+  double size = ( seconds_ > 0.0 ) ? std::ceil ( latency_ / seconds_ ) : (double) maximum_;
+  size_ = (int64_t) std::min ( std::max ( size, 1.0 ), (double) maximum_ );
+}
+
+inline int64_t SubsampleBatch::
+size ( void ) const {
+  return size_;
+}
+
+#endif
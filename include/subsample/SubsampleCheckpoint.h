@@ -0,0 +1,297 @@
+/// SubsampleCheckpoint.h
+///   This file provides the class "SubsampleCheckpoint" which saves
+///   and restores the coordinator state of the "Subsample" program
+///   (the metric tree, the distance cache, the position in the sample,
+///   and the results of each level) so that a long run may be
+///   resumed after it is interrupted. Checkpoints are taken at cohort
+///   boundaries, when no operations are in flight. Points are stored
+///   by "id" only; they are recovered from the sample on restore.
+///   The file format has a version, which must be incremented when
+///   SubsampleCheckpointState or SubsampleLevel changes; checkpoints
+///   of other versions are rejected.
+
+#ifndef SUBSAMPLECHECKPOINT_H
+#define SUBSAMPLECHECKPOINT_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <stdexcept>
+
+#include "boost/archive/binary_oarchive.hpp"
+#include "boost/archive/binary_iarchive.hpp"
+#include "boost/serialization/serialization.hpp"
+#include "boost/serialization/vector.hpp"
+#include "boost/serialization/string.hpp"
+#include "boost/serialization/version.hpp"
+
+#include "geometry/MetricTree.h"
+
+/// SubsampleLevel
+///   The results of a run for one delta. The arrays are indexed by 
+///   sample id. The witness of a sample is a subsample point within
+///   delta of it, found while the subsample was being built.
+struct SubsampleLevel {
+  int64_t size; // number of subsample points, or -1 if not complete
+  std::vector<int64_t> nearest; // id of nearest subsample point
+  std::vector<int64_t> witness; // id of witness (-1 if none)
+  std::vector<double> witness_distance; // distance to witness
+  SubsampleLevel ( void ) : size ( -1 ) {}
+  template<class Archive>
+  void serialize (Archive & ar, const unsigned int /* version */) {
+    ar & size;
+    ar & nearest;
+    ar & witness;
+    ar & witness_distance;
+  }
+};
+
+/// SubsampleCheckpointState
+///   On-disk format of a checkpoint
+struct SubsampleCheckpointState {
+  static const unsigned int current_version = 2;
+  std::vector<double> deltas;
+  double metric;
+  double relative_error;
+  int64_t partition;
+  int64_t num_partitions;
+  uint64_t inputs;
+  int64_t position;
+  std::vector<int64_t> order;
+  std::vector<int64_t> tree_ids;
+  std::vector<int64_t> tree_left;
+  std::vector<int64_t> tree_right;
+  std::vector<int64_t> tree_parent;
+  std::vector<double> tree_radius;
+  std::vector<int64_t> cache_p;
+  std::vector<int64_t> cache_q;
+  std::vector<double> cache_dist;
+  std::vector<SubsampleLevel> levels;
+  template<class Archive>
+  void serialize (Archive & ar, const unsigned int version) {
+    if ( version != current_version ) {
+      throw std::runtime_error ( "Unsupported checkpoint version " + 
+                                 std::to_string ( version ) );
+    }
+    ar & deltas;
+    ar & metric;
+    ar & relative_error;
+    ar & partition;
+    ar & num_partitions;
+    ar & inputs;
+    ar & position;
+    ar & order;
+    ar & tree_ids;
+    ar & tree_left;
+    ar & tree_right;
+    ar & tree_parent;
+    ar & tree_radius;
+    ar & cache_p;
+    ar & cache_q;
+    ar & cache_dist;
+    ar & levels;
+  }
+};
+
+BOOST_CLASS_VERSION ( SubsampleCheckpointState, SubsampleCheckpointState::current_version )
+
+class SubsampleCheckpoint {
+public:
+  /// SubsampleCheckpoint
+  ///   Construct a disabled checkpoint
+  SubsampleCheckpoint ( void );
+
+  /// assign
+  ///   Checkpoint to "filename" at most once every "interval" seconds.
+  ///   The "deltas", "metric" and "relative_error" parameters are 
+  ///   recorded and checked on restore (cached distances computed with
+  ///   another relative error cannot be reused), as are the partition
+  ///   "partition" of "num_partitions" and a hash "inputs" of the 
+  ///   outputs of other runs the run starts from (--incremental, 
+  ///   --merge). An empty filename disables checkpointing.
+  void
+  assign ( std::string const& filename,
+           double interval,
+           std::vector<double> const& deltas,
+           double metric,
+           double relative_error,
+           int64_t partition,
+           int64_t num_partitions,
+           uint64_t inputs );
+
+  /// enabled
+  ///   Return true if checkpointing is enabled
+  bool
+  enabled ( void ) const;
+
+  /// write
+  ///   Save the coordinator state to the checkpoint file. "levels"
+  ///   holds the results of each level (delta) of the run.
+  ///   Unless "force" is true, nothing is written if the previous 
+  ///   checkpoint was taken less than "interval" seconds ago. 
+  ///   The file is replaced atomically.
+  template < class T, class D > void
+  write ( MetricTree<T,D> const& mt,
+          D const& distance,
+          std::vector<T> const& samples,
+          int64_t position,
+          std::vector<SubsampleLevel> const& levels,
+          bool force = false );
+
+  /// read
+  ///   Restore the coordinator state from the checkpoint file.
+  ///   "samples" is reordered to the order of the checkpointed run.
+  ///   Return false (and change nothing) if there is no checkpoint file.
+  ///   Throw if the checkpoint does not belong to this run.
+  template < class T, class D > bool
+  read ( MetricTree<T,D> * mt,
+         D * distance,
+         std::vector<T> * samples,
+         int64_t * position,
+         std::vector<SubsampleLevel> * levels );
+
+private:
+  std::string filename_;
+  double interval_;
+  std::vector<double> deltas_;
+  double metric_;
+  double relative_error_;
+  int64_t partition_;
+  int64_t num_partitions_;
+  uint64_t inputs_;
+  std::chrono::steady_clock::time_point last_write_;
+  bool written_;
+};
+
+inline SubsampleCheckpoint::
+SubsampleCheckpoint ( void ) : interval_ ( 0.0 ), metric_ ( 0.0 ), 
+  relative_error_ ( 0.0 ), partition_ ( 0 ), num_partitions_ ( 1 ),
+  inputs_ ( 0 ), written_ ( false ) {}
+
+inline void SubsampleCheckpoint::
+assign ( std::string const& filename,
+         double interval,
+         std::vector<double> const& deltas,
+         double metric,
+         double relative_error,
+         int64_t partition,
+         int64_t num_partitions,
+         uint64_t inputs ) {
+  filename_ = filename;
+  interval_ = interval;
+  deltas_ = deltas;
+  metric_ = metric;
+  relative_error_ = relative_error;
+  partition_ = partition;
+  num_partitions_ = num_partitions;
+  inputs_ = inputs;
+  written_ = false;
+}
+
+inline bool SubsampleCheckpoint::
+enabled ( void ) const {
+  return not filename_ . empty ();
+}
+
+template < class T, class D > void SubsampleCheckpoint::
+write ( MetricTree<T,D> const& mt,
+        D const& distance,
+        std::vector<T> const& samples,
+        int64_t position,
+        std::vector<SubsampleLevel> const& levels,
+        bool force ) {
+  if ( not enabled () ) return;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+  if ( written_ && not force ) {
+    double elapsed = std::chrono::duration<double> ( now - last_write_ ) . count ();
+    if ( elapsed < interval_ ) return;
+  }
+  SubsampleCheckpointState state;
+  state . deltas = deltas_;
+  state . metric = metric_;
+  state . relative_error = relative_error_;
+  state . partition = partition_;
+  state . num_partitions = num_partitions_;
+  state . inputs = inputs_;
+  state . position = position;
+  for ( T const& p : samples ) state . order . push_back ( p . id );
+  for ( int64_t i = 0; i < mt . size (); ++ i ) {
+    typename MetricTree<T,D>::iterator it = mt . node ( i );
+    state . tree_ids . push_back ( it -> id );
+    state . tree_left . push_back ( mt . index ( mt . left ( it ) ) );
+    state . tree_right . push_back ( mt . index ( mt . right ( it ) ) );
+    state . tree_parent . push_back ( mt . index ( mt . parent ( it ) ) );
+    state . tree_radius . push_back ( mt . radius ( it ) );
+  }
+  distance . entries ( &state . cache_p, &state . cache_q, &state . cache_dist );
+  state . levels = levels;
+
+  std::string tempname = filename_ + ".tmp";
+  {
+    std::ofstream outfile ( tempname, std::ios::binary );
+    if ( not outfile ) {
+      throw std::runtime_error ( "SubsampleCheckpoint::write. Cannot open " + tempname );
+    }
+    boost::archive::binary_oarchive oa ( outfile );
+    oa << state;
+  }
+  if ( std::rename ( tempname . c_str (), filename_ . c_str () ) != 0 ) {
+    throw std::runtime_error ( "SubsampleCheckpoint::write. Cannot replace " + filename_ );
+  }
+  last_write_ = now;
+  written_ = true;
+}
+
+template < class T, class D > bool SubsampleCheckpoint::
+read ( MetricTree<T,D> * mt,
+       D * distance,
+       std::vector<T> * samples,
+       int64_t * position,
+       std::vector<SubsampleLevel> * levels ) {
+  if ( not enabled () ) return false;
+  std::ifstream infile ( filename_, std::ios::binary );
+  if ( not infile ) return false;
+  SubsampleCheckpointState state;
+  try {
+    boost::archive::binary_iarchive ia ( infile );
+    ia >> state;
+  } catch ( std::exception const& e ) {
+    throw std::runtime_error ( "SubsampleCheckpoint::read. Cannot read " + filename_ +
+                               ": " + e . what () );
+  }
+  if ( state . deltas != deltas_ ||
+       not ( state . metric == metric_ ||
+             ( std::isinf ( state . metric ) && std::isinf ( metric_ ) ) ) ||
+       state . relative_error != relative_error_ ||
+       state . partition != partition_ ||
+       state . num_partitions != num_partitions_ ||
+       state . inputs != inputs_ ||
+       state . order . size () != samples -> size () ) {
+    throw std::runtime_error ( "SubsampleCheckpoint::read. " + filename_ +
+                               " was written by a run with different parameters." );
+  }
+  // Samples are identified by id, which is their index in the sample file
+  std::vector<T> by_id ( samples -> size () );
+  for ( T const& p : * samples ) by_id [ p . id ] = p;
+  for ( int64_t i = 0; i < state . order . size (); ++ i ) {
+    (*samples) [ i ] = by_id [ state . order [ i ] ];
+  }
+  std::vector<T> points;
+  for ( int64_t id : state . tree_ids ) points . push_back ( by_id [ id ] );
+  mt -> restore ( points, state . tree_left, state . tree_right,
+                  state . tree_parent, state . tree_radius );
+  for ( int64_t i = 0; i < state . cache_dist . size (); ++ i ) {
+    distance -> cache ( state . cache_p [ i ], state . cache_q [ i ],
+                        state . cache_dist [ i ] );
+  }
+  * position = state . position;
+  * levels = state . levels;
+  last_write_ = std::chrono::steady_clock::now ();
+  written_ = true;
+  return true;
+}
+
+#endif
@@ -9,7 +9,10 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <sstream>
 #include <algorithm>
+#include <numeric>
+#include <functional>
 #include <cstdlib>
 #include <cmath>
 #include <limits>
@@ -17,9 +20,13 @@
 #include <exception>
 
 #include "boost/serialization/serialization.hpp"
+#include "boost/shared_ptr.hpp"
 #include "persistence/PersistenceDiagram.h"
+#include "persistence/PersistenceDiagramStore.h"
 #include "persistence/WassersteinDistance.h"
+#include "persistence/AuctionWassersteinDistance.h"
 #include "persistence/BottleneckDistance.h"
+#include "subsample/DistanceStore.h"
 
 #include "tools/json.hpp"
 using json = nlohmann::json;
@@ -28,8 +35,31 @@ class Point {
 public:
   int64_t id;
   std::vector<PersistenceDiagram> pd;
+  std::vector<double> summary; // see Distance::summarize (not serialized)
   Point ( void ) {}
   Point ( std::vector<PersistenceDiagram> const& pd ) : pd(pd) {}
+  /// hash
+  ///   Return a hash (FNV-1a) of the contents of the diagrams, which 
+  ///   identifies the point independently of its id and is the same
+  ///   in every run.
+  uint64_t hash ( void ) const {
+    uint64_t result = 14695981039346656037ULL;
+    auto mix = [&] ( void const* data, std::size_t size ) {
+      unsigned char const* bytes = (unsigned char const*) data;
+      for ( std::size_t i = 0; i < size; ++ i ) {
+        result = ( result ^ bytes [ i ] ) * 1099511628211ULL;
+      }
+    };
+    for ( PersistenceDiagram const& diagram : pd ) {
+      uint64_t size = diagram . size ();
+      mix ( &size, sizeof ( size ) );
+      for ( Generator const& g : diagram ) {
+        mix ( &g . birth, sizeof ( g . birth ) );
+        mix ( &g . death, sizeof ( g . death ) );
+      }
+    }
+    return result;
+  }
 private:
   friend class boost::serialization::access; 
   template<class Archive>
@@ -42,30 +72,205 @@ private:
 class Distance {
 public:
   Distance ( void ) {}
-  Distance ( double p ) : p_(p) {}
-  double operator () ( Point const& p, Point const& q ) const {
+  /// Distance
+  ///   Wasserstein-p distance (bottleneck if p is inf). If "relative_error"
+  ///   is positive, Wasserstein distances are approximated within it by
+  ///   the auction algorithm instead of computed exactly.
+  Distance ( double p, double relative_error = 0.0 ) 
+    : p_(p), relative_error_(relative_error) {}
+  /// operator ()
+  ///   Return the distance between p and q. If it exceeds "bound" the
+  ///   solvers may stop early and return a lower bound on it which 
+  ///   exceeds "bound" (a result at most "bound" is the distance).
+  double operator () ( Point const& p, Point const& q,
+                       double bound = std::numeric_limits<double>::infinity() ) const {
     uint64_t N = p . pd . size ();
     double result = 0.0;
     if ( std::isinf(p_) ) {
       for ( uint64_t i = 0; i < N; ++ i ) {
-        result = std::max(result, BottleneckDistance ( p.pd[i], q.pd[i] ) );
+        result = std::max(result, BottleneckDistance ( p.pd[i], q.pd[i], bound ) );
+        if ( result > bound ) break;
       }
       return result;
     } else {
+      // Each diagram is bounded by what remains of the p-th power of the bound
+      double remaining = std::pow ( bound, p_ );
       for ( uint64_t i = 0; i < N; ++ i ) {
-        result += std::pow ( WassersteinDistance ( p.pd[i], q.pd[i], p_), p_ );
+        double diagram_bound = std::pow ( std::max ( remaining - result, 0.0 ), 1.0 / p_ );
+        double d = ( relative_error_ > 0.0 ) 
+          ? AuctionWassersteinDistance ( p.pd[i], q.pd[i], p_, relative_error_, diagram_bound )
+          : WassersteinDistance ( p.pd[i], q.pd[i], p_, diagram_bound );
+        result += std::pow ( d, p_ );
+        if ( d > diagram_bound ) break;
       }
-      result = std::pow ( result, 1.0 / p_ );
-      //std::cout << "Distance = " << result << "\n";
-      return result;
+      double distance = std::pow ( result, 1.0 / p_ );
+      if ( result > remaining && distance <= bound ) {
+        distance = std::nextafter ( bound, std::numeric_limits<double>::infinity() );
+      }
+      //std::cout << "Distance = " << distance << "\n";
+      return distance;
     }
   }
+  /// cost
+  ///   Estimate the relative cost of computing the distance from the 
+  ///   diagram sizes. Each pair of diagrams is a matching problem on
+  ///   n = (size of both) generators; the Jonker-Volgenant solver used
+  ///   for the Wasserstein distance is O(n^3) in the worst case, and the
+  ///   bottleneck distance sorts O(n^2) edges. The auction algorithm is
+  ///   taken to be O(n^2).
+  double cost ( Point const& p, Point const& q ) const {
+    uint64_t N = p . pd . size ();
+    double result = 0.0;
+    for ( uint64_t i = 0; i < N; ++ i ) {
+      double n = p.pd[i].size() + q.pd[i].size();
+      if ( std::isinf(p_) ) result += n * n * std::log2 ( n + 2.0 );
+      else if ( relative_error_ > 0.0 ) result += n * n;
+      else result += n * n * n;
+    }
+    return result;
+  }
+  /// summarize
+  ///   Compute the summary of "point" used by "lower": for each diagram, 
+  ///   the summary_size largest distances of its generators to the 
+  ///   diagonal (decreasing, padded with zeros), then the p-norm of the
+  ///   others. Points with infinite generators get no summary, nor do
+  ///   any for p < 1 (when sorted lists need not match optimally).
+  void summarize ( Point * point ) const {
+    point -> summary . clear ();
+    if ( p_ < 1.0 ) return;
+    std::vector<double> summary;
+    Generator::Distance distance;
+    for ( PersistenceDiagram const& diagram : point -> pd ) {
+      std::vector<double> persistence;
+      for ( Generator const& g : diagram ) {
+        double h = distance . diagonal ( g );
+        if ( not std::isfinite ( h ) || h < 0.0 ) return;
+        persistence . push_back ( h );
+      }
+      int64_t k = std::min<int64_t> ( summary_size, persistence . size () );
+      std::partial_sort ( persistence . begin (), persistence . begin () + k, 
+                          persistence . end (), std::greater<double> () );
+      double tail = 0.0;
+      if ( not std::isinf ( p_ ) ) {
+        for ( int64_t i = k; i < persistence . size (); ++ i ) tail += std::pow ( persistence [ i ], p_ );
+        tail = std::pow ( tail, 1.0 / p_ );
+      }
+      for ( int64_t i = 0; i < summary_size; ++ i ) {
+        summary . push_back ( ( i < k ) ? persistence [ i ] : 0.0 );
+      }
+      summary . push_back ( tail );
+    }
+    point -> summary . swap ( summary );
+  }
+  /// lower
+  ///   Return a lower bound on the distance between p and q from their
+  ///   summaries (0 if either has none). A matching moves the distances
+  ///   of generators to the diagonal by at most its cost, so the distance
+  ///   is at least that between the sorted lists of these distances:
+  ///   the largest difference of the k-th largest (bottleneck), or the 
+  ///   p-norm of the differences, bounded below on the rest by the 
+  ///   difference of their p-norms (Wasserstein). It is reduced slightly
+  ///   to allow for rounding.
+  double lower ( Point const& p, Point const& q ) const {
+    if ( p . summary . empty () || p . summary . size () != q . summary . size () ) return 0.0;
+    double result = 0.0;
+    for ( uint64_t i = 0; i < p . summary . size (); ++ i ) {
+      double difference = std::abs ( p . summary [ i ] - q . summary [ i ] );
+      if ( not std::isinf ( p_ ) ) result += std::pow ( difference, p_ );
+      else if ( i % ( summary_size + 1 ) < summary_size ) result = std::max ( result, difference );
+    }
+    if ( not std::isinf ( p_ ) ) result = std::pow ( result, 1.0 / p_ );
+    return result * ( 1.0 - 1e-9 );
+  }
 private:
+  static const int64_t summary_size = 8;
   double p_;
+  double relative_error_;
 };
 
 
 
+/// parseNumber
+///   Return the "value" of the option "key" as a number of at least
+///   "minimum". Throw if it is not one.
+inline double
+parseNumber ( std::string const& key, std::string const& value, double minimum ) {
+  std::size_t end = 0;
+  double result = std::numeric_limits<double>::quiet_NaN ();
+  try {
+    result = std::stod ( value, &end );
+  } catch ( std::exception const& ) {}
+  if ( value . empty () || end != value . size () || not ( result >= minimum ) ) {
+    std::stringstream ss;
+    ss << "Expected a number of at least " << minimum << " in " << key << "=" << value;
+    throw std::logic_error ( ss . str () );
+  }
+  return result;
+}
+
+/// parseInteger
+///   Return the "value" of the option "key" as an integer of at least
+///   "minimum". Throw if it is not one.
+inline int64_t
+parseInteger ( std::string const& key, std::string const& value, int64_t minimum ) {
+  std::size_t end = 0;
+  int64_t result = minimum - 1;
+  try {
+    result = std::stoll ( value, &end );
+  } catch ( std::exception const& ) {}
+  if ( value . empty () || end != value . size () || result < minimum ) {
+    throw std::logic_error ( "Expected an integer of at least " + 
+                             std::to_string ( minimum ) + " in " + key + "=" + value );
+  }
+  return result;
+}
+
+/// loadPoints
+///   Return the points with the given ids. "sample_array" is the json 
+///   array of tuples of diagram files (relative to "basepath") of a 
+///   sample file, and an id is an index into it. If "store_filename" is 
+///   not empty the diagrams of every sample are mapped from a shared 
+///   PersistenceDiagramStore (built if need be), which is returned in 
+///   "store" and must outlive the points.
+inline std::vector<Point>
+loadPoints ( json const& sample_array,
+             std::string const& basepath,
+             std::vector<int64_t> const& ids,
+             std::string const& store_filename,
+             boost::shared_ptr<PersistenceDiagramStore> * store ) {
+  std::vector<Point> points;
+  if ( store_filename . empty () ) {
+    for ( int64_t id : ids ) {
+      Point p;
+      p . id = id;
+      for ( std::string path : sample_array[id] ) {
+        p.pd.push_back(PersistenceDiagram(basepath + "/" + path));
+      }
+      points . push_back ( p );
+    }
+    return points;
+  }
+  std::vector<std::string> paths;
+  std::vector<int64_t> first; // index of first diagram of each sample
+  for ( json const& tuple : sample_array ) {
+    first . push_back ( paths . size () );
+    for ( std::string path : tuple ) {
+      paths . push_back ( basepath + "/" + path );
+    }
+  }
+  first . push_back ( paths . size () );
+  store -> reset ( new PersistenceDiagramStore ( store_filename, paths ) );
+  for ( int64_t id : ids ) {
+    Point p;
+    p . id = id;
+    for ( int64_t i = first [ id ]; i < first [ id + 1 ]; ++ i ) {
+      p.pd.push_back((*store) -> diagram ( i ));
+    }
+    points . push_back ( p );
+  }
+  return points;
+}
+
 /// Functions for Subsample.cpp
 
 class SubsampleConfig {
@@ -92,9 +297,149 @@ public:
 
   /// getDelta ( void )
   ///   Return the delta parameter (for delta-dense, delta-sparse subsampling)
+  ///   If several deltas were given, return the first (largest).
   double
   getDelta ( void ) const;
 
+  /// getDeltas ( void )
+  ///   Return the decreasing list of delta parameters. A nested subsample
+  ///   is computed for each of them.
+  std::vector<double> const&
+  getDeltas ( void ) const;
+
+  /// getMetric ( void )
+  ///   Return the metric parameter p (Wasserstein-p, or inf for Bottleneck)
+  double
+  getMetric ( void ) const;
+
+  /// getRelativeError ( void )
+  ///   Return the relative error of approximate Wasserstein distances
+  ///   (0 if they are exact)
+  double
+  getRelativeError ( void ) const;
+
+  /// getCheckpointFile
+  ///   Return the checkpoint filename (empty if checkpointing is disabled)
+  std::string const&
+  getCheckpointFile ( void ) const;
+
+  /// getCheckpointInterval
+  ///   Return the minimum number of seconds between checkpoints
+  double
+  getCheckpointInterval ( void ) const;
+
+  /// getResume
+  ///   Return true if the run should resume from the checkpoint file
+  bool
+  getResume ( void ) const;
+
+  /// getTimeLimit
+  ///   Return the number of seconds after which the run stops at the
+  ///   next cohort boundary, to be resumed from its checkpoint (inf if
+  ///   there is no limit)
+  double
+  getTimeLimit ( void ) const;
+
+  /// getTelemetryFile
+  ///   Return the telemetry filename (empty if telemetry is disabled)
+  std::string const&
+  getTelemetryFile ( void ) const;
+
+  /// getTelemetryInterval
+  ///   Return the number of seconds between telemetry records
+  double
+  getTelemetryInterval ( void ) const;
+
+  /// getExactNearest
+  ///   Return true if the exact nearest subsample point of each sample
+  ///   is to be computed. Otherwise only the witnesses (subsample points
+  ///   within delta, found without extra distance computations) are output.
+  bool
+  getExactNearest ( void ) const;
+
+  /// getSpeculationBudget
+  ///   Return the maximum number of distances to compute speculatively
+  ///   (before they are requested) when workers would otherwise be idle
+  int64_t
+  getSpeculationBudget ( void ) const;
+
+  /// getCoordinatorThreads
+  ///   Return the number of coordinator threads which run searches
+  int64_t
+  getCoordinatorThreads ( void ) const;
+
+  /// getLocalDistanceTime
+  ///   Return the time (in seconds) below which a distance is computed
+  ///   on the coordinator rather than sent to a worker (0 to disable)
+  double
+  getLocalDistanceTime ( void ) const;
+
+  /// getBatchSize
+  ///   Return the number of distances sent to a worker in one job,
+  ///   or 0 to adapt it to the measured latency
+  int64_t
+  getBatchSize ( void ) const;
+
+  /// getMaxBatchSize
+  ///   Return the largest number of distances sent to a worker in one 
+  ///   job when the batch size is adapted
+  int64_t
+  getMaxBatchSize ( void ) const;
+
+  /// getDistanceStore
+  ///   Return the filename of the persistent distance store, or the
+  ///   empty string if there is none
+  std::string const&
+  getDistanceStore ( void ) const;
+
+  /// getCacheMemory
+  ///   Return the bound (in bytes) on the memory used by the distance
+  ///   cache, or 0 if it is unbounded
+  int64_t
+  getCacheMemory ( void ) const;
+
+  /// getStragglerFactor
+  ///   Return the factor by which a job must exceed its expected time
+  ///   to be sent again to an idle worker (0 to disable)
+  double
+  getStragglerFactor ( void ) const;
+
+  /// getPreviousSubsample
+  ///   Return the ids of the subsample of a previous run to be
+  ///   updated incrementally (empty unless run with --incremental)
+  std::vector<int64_t> const&
+  getPreviousSubsample ( void ) const;
+
+  /// getPreviousNearest
+  ///   Return the nearest subsample ids reported by the previous run
+  ///   (its witnesses, with --nearest=witness), indexed by sample id. Its size is the number of samples in the
+  ///   previous run; these must be the first samples of the sample file.
+  std::vector<int64_t> const&
+  getPreviousNearest ( void ) const;
+
+  /// getPartition
+  ///   Return the partition to subsample (with --partition=k/K), 
+  ///   counting from 0, or 0 if the samples are not partitioned
+  int64_t
+  getPartition ( void ) const;
+
+  /// getNumPartitions
+  ///   Return the number of partitions (1 if not partitioned)
+  int64_t
+  getNumPartitions ( void ) const;
+
+  /// getMergeSubsample
+  ///   Return the union of the subsamples of the partitions being
+  ///   merged (empty unless run with --merge)
+  std::vector<int64_t> const&
+  getMergeSubsample ( void ) const;
+
+  /// getMergeWitness
+  ///   Return the witness of each sample (indexed by id) in the 
+  ///   subsample of its partition (empty unless run with --merge)
+  std::vector<int64_t> const&
+  getMergeWitness ( void ) const;
+
   /// getSamples
   ///   Return collection of samples (Points)
   std::vector<Point> const&
@@ -102,20 +447,55 @@ public:
 
   /// handleResults
   ///   Handle the results returned from the main program
-  ///   (i.e. produce output from the subsample)
+  ///   (i.e. produce output from the subsample) for the
+  ///   given level (index into getDeltas ()). "nearest" 
+  ///   may be empty if it was not computed.
   void
   handleResults ( std::vector<Point> const& results, 
-                  std::vector<int64_t> const& nearest ) const;
+                  std::vector<int64_t> const& nearest,
+                  std::vector<int64_t> const& witness,
+                  int64_t level = 0 ) const;
 
 private:
+  /// readPrevious
+  ///   Read the output of a previous run, which must have
+  ///   used the same delta, p and relative error
+  json
+  readPrevious ( std::string const& filename ) const;
+
   int argc_;
   char ** argv_;
   std::string samples_filename_;
-  double delta_;
+  std::vector<double> deltas_;
+  std::vector<std::string> delta_strings_;
   double metric_;
   std::string subsample_filename_;
   Distance distance_;
   int64_t cohort_size_;
+  std::string checkpoint_filename_;
+  double checkpoint_interval_;
+  bool resume_;
+  double time_limit_;
+  std::string telemetry_filename_;
+  double telemetry_interval_;
+  bool exact_nearest_;
+  int64_t speculation_budget_;
+  int64_t coordinator_threads_;
+  double local_distance_time_;
+  int64_t batch_size_;
+  int64_t max_batch_size_;
+  double straggler_factor_;
+  int64_t cache_memory_;
+  std::string distance_store_filename_;
+  double relative_error_;
+  std::vector<int64_t> previous_subsample_;
+  std::vector<int64_t> previous_nearest_;
+  int64_t partition_;
+  int64_t num_partitions_;
+  std::vector<int64_t> merge_subsample_;
+  std::vector<int64_t> merge_witness_;
+  std::string diagram_store_filename_;
+  boost::shared_ptr<PersistenceDiagramStore> diagram_store_;
   std::vector<Point> samples_;
 };
 
@@ -129,19 +509,166 @@ SubsampleConfig ( int argc, char * argv [] ) {
 
 inline void SubsampleConfig::
 assign ( int argc, char * argv [] ) {
-  if ( argc != 5 ) {
-    std::cout << "Give four arguments: /path/to/sample.json delta p /path/to/subsample.json \n";
-    std::cout << " (Note: the last argument is the output file.)\n";
+  if ( argc < 5 ) {
+    std::cout << "Give four arguments: /path/to/sample.json delta p /path/to/subsample.json [options]\n";
+    std::cout << " (Note: the fourth argument is the output file.)\n";
+    std::cout << " A decreasing, comma-separated list of deltas (e.g. 100,10,1) produces nested\n";
+    std::cout << " subsamples, written to /path/to/subsample_<delta>.json\n";
+    std::cout << " Options:\n";
+    std::cout << "  --checkpoint=/path/to/checkpoint  save progress at cohort boundaries\n";
+    std::cout << "  --checkpoint-interval=seconds     minimum time between checkpoints (default 600)\n";
+    std::cout << "  --resume                          resume from the checkpoint, if it exists\n";
+    std::cout << "  --time-limit=seconds              stop at the first cohort boundary after this\n";
+    std::cout << "                                    time, to be resumed from the checkpoint\n";
+    std::cout << "  --cohort-size=N                   number of samples in a cohort (default 1000)\n";
+    std::cout << "  --telemetry=/path/to/telemetry    append progress records (JSON lines)\n";
+    std::cout << "  --telemetry-interval=seconds      time between progress records (default 10)\n";
+    std::cout << "  --nearest=exact|witness           compute exact nearest subsample points (default),\n";
+    std::cout << "                                    or only report a subsample point within delta\n";
+    std::cout << "  --speculation-budget=N            compute up to N distances ahead of time when\n";
+    std::cout << "                                    workers are idle (default 0)\n";
+    std::cout << "  --coordinator-threads=K           run the coordinator's tree searches on K threads\n";
+    std::cout << "                                    (default 1)\n";
+    std::cout << "  --local-distance-time=seconds     compute distances expected to take less time\n";
+    std::cout << "                                    on the coordinator (default 0, none)\n";
+    std::cout << "  --batch-size=B|auto               send B distances to a worker per job, or adapt\n";
+    std::cout << "                                    to the network latency (default 1)\n";
+    std::cout << "  --max-batch-size=M                largest batch with --batch-size=auto (default 64)\n";
+    std::cout << "  --straggler-factor=F              send a job again to an idle worker if it takes\n";
+    std::cout << "                                    F times longer than expected (default 4; 0 = never)\n";
+    std::cout << "  --cache-memory=MB                 bound the memory of the distance cache (default 0,\n";
+    std::cout << "                                    unbounded)\n";
+    std::cout << "  --distance-store=/path/to/store   reuse and save distances in a file shared by runs\n";
+    std::cout << "  --relative-error=E                approximate Wasserstein distances within relative\n";
+    std::cout << "                                    error E by the auction algorithm (default 0, exact)\n";
+    std::cout << "  --incremental=/path/to/old.json   update the subsample of a previous run on a\n";
+    std::cout << "                                    prefix of the samples\n";
+    std::cout << "  --partition=k/K                   subsample only partition k (0 <= k < K) of the\n";
+    std::cout << "                                    samples, which are split by nearest pivot\n";
+    std::cout << "  --merge=/path/to/0.json,...       merge the subsamples of all K partitions\n";
+    std::cout << "  --diagram-store=/path/to/store    map the diagrams from a file shared by all\n";
+    std::cout << "                                    processes (e.g. in /dev/shm), built if need be\n";
     throw std::logic_error ( "Bad arguments." );
   }
   argc_ = argc;
   argv_ = argv;
   samples_filename_ = argv[1];
-  delta_ = std::stod ( argv[2] );
-  metric_ = std::stod ( argv[3] );
+  std::stringstream delta_stream ( argv[2] );
+  std::string delta_string;
+  while ( std::getline ( delta_stream, delta_string, ',' ) ) {
+    delta_strings_ . push_back ( delta_string );
+    deltas_ . push_back ( parseNumber ( "delta", delta_string, 0.0 ) );
+    if ( deltas_ . size () > 1 && 
+         not ( deltas_ [ deltas_ . size () - 1 ] < deltas_ [ deltas_ . size () - 2 ] ) ) {
+      throw std::logic_error ( "Deltas must be given in decreasing order." );
+    }
+  }
+  if ( deltas_ . empty () ) {
+    throw std::logic_error ( "No delta given." );
+  }
+  metric_ = parseNumber ( "p", argv[3], 1.0 );
   subsample_filename_ = argv[4];
-  distance_ = Distance ( metric_ );
+  relative_error_ = 0.0;
   cohort_size_ = 1000;
+  std::string incremental_filename;
+  std::string merge_filenames;
+  partition_ = 0;
+  num_partitions_ = 1;
+  checkpoint_interval_ = 600.0;
+  resume_ = false;
+  time_limit_ = std::numeric_limits<double>::infinity();
+  telemetry_interval_ = 10.0;
+  exact_nearest_ = true;
+  speculation_budget_ = 0;
+  coordinator_threads_ = 1;
+  local_distance_time_ = 0.0;
+  batch_size_ = 1;
+  max_batch_size_ = 64;
+  straggler_factor_ = 4.0;
+  cache_memory_ = 0;
+  for ( int i = 5; i < argc; ++ i ) {
+    std::string arg = argv[i];
+    std::string key = arg . substr ( 0, arg . find ( '=' ) );
+    std::string value = ( key . size () < arg . size () ) ? arg . substr ( key . size () + 1 ) : "";
+    if ( key == "--checkpoint" ) {
+      checkpoint_filename_ = value;
+    } else if ( key == "--checkpoint-interval" ) {
+      checkpoint_interval_ = parseNumber ( key, value, 0.0 );
+    } else if ( arg == "--resume" ) {
+      resume_ = true;
+    } else if ( key == "--time-limit" ) {
+      time_limit_ = parseNumber ( key, value, 0.0 );
+    } else if ( key == "--cohort-size" ) {
+      cohort_size_ = parseInteger ( key, value, 1 );
+    } else if ( key == "--telemetry" ) {
+      telemetry_filename_ = value;
+    } else if ( key == "--telemetry-interval" ) {
+      telemetry_interval_ = parseNumber ( key, value, 0.0 );
+    } else if ( key == "--nearest" ) {
+      if ( value != "exact" && value != "witness" ) {
+        throw std::logic_error ( "Unrecognized option " + arg );
+      }
+      exact_nearest_ = ( value == "exact" );
+    } else if ( key == "--speculation-budget" ) {
+      speculation_budget_ = parseInteger ( key, value, 0 );
+    } else if ( key == "--coordinator-threads" ) {
+      coordinator_threads_ = parseInteger ( key, value, 1 );
+    } else if ( key == "--local-distance-time" ) {
+      local_distance_time_ = parseNumber ( key, value, 0.0 );
+    } else if ( key == "--batch-size" ) {
+      batch_size_ = ( value == "auto" ) ? 0 : parseInteger ( key, value, 1 );
+    } else if ( key == "--max-batch-size" ) {
+      max_batch_size_ = parseInteger ( key, value, 1 );
+    } else if ( key == "--straggler-factor" ) {
+      straggler_factor_ = parseNumber ( key, value, 0.0 );
+    } else if ( key == "--cache-memory" ) {
+      cache_memory_ = (int64_t) ( parseNumber ( key, value, 0.0 ) * 1024.0 * 1024.0 );
+    } else if ( key == "--distance-store" ) {
+      distance_store_filename_ = value;
+    } else if ( key == "--relative-error" ) {
+      relative_error_ = parseNumber ( key, value, 0.0 );
+    } else if ( key == "--incremental" ) {
+      incremental_filename = value;
+    } else if ( key == "--partition" ) {
+      std::size_t slash = value . find ( '/' );
+      if ( slash == std::string::npos ) {
+        throw std::logic_error ( "Expected --partition=k/K" );
+      }
+      partition_ = parseInteger ( key, value . substr ( 0, slash ), 0 );
+      num_partitions_ = parseInteger ( key, value . substr ( slash + 1 ), 1 );
+      if ( partition_ >= num_partitions_ ) {
+        throw std::logic_error ( "Expected --partition=k/K with 0 <= k < K" );
+      }
+    } else if ( key == "--merge" ) {
+      merge_filenames = value;
+    } else if ( key == "--diagram-store" ) {
+      diagram_store_filename_ = value;
+    } else {
+      throw std::logic_error ( "Unrecognized option " + arg );
+    }
+  }
+  if ( relative_error_ > 0.0 && not distance_store_filename_ . empty () ) {
+    // The store is keyed by p alone and would mix exact and approximate distances
+    throw std::logic_error ( "--relative-error cannot be used with --distance-store" );
+  }
+  distance_ = Distance ( metric_, relative_error_ );
+  if ( resume_ && checkpoint_filename_ . empty () ) {
+    throw std::logic_error ( "--resume requires --checkpoint=/path/to/checkpoint" );
+  }
+  if ( not std::isinf ( time_limit_ ) && checkpoint_filename_ . empty () ) {
+    throw std::logic_error ( "--time-limit requires --checkpoint=/path/to/checkpoint" );
+  }
+  if ( deltas_ . size () > 1 && not incremental_filename . empty () ) {
+    throw std::logic_error ( "--incremental requires a single delta" );
+  }
+  if ( ( num_partitions_ > 1 || not merge_filenames . empty () ) && 
+       ( deltas_ . size () > 1 || not incremental_filename . empty () ) ) {
+    throw std::logic_error ( "--partition and --merge require a single delta"
+                             " and cannot be used with --incremental" );
+  }
+  if ( num_partitions_ > 1 && not merge_filenames . empty () ) {
+    throw std::logic_error ( "--partition and --merge cannot be used together" );
+  }
 
   //std::cout << "Loading samples...\n";
   
@@ -151,19 +678,66 @@ assign ( int argc, char * argv [] ) {
 
   json sample_array = samples_json["sample"];
   std::string basepath = samples_json["path"];
-  int64_t id = 0;
-  for ( json const& tuple : sample_array ) {
-    Point p;
-    p . id = id ++;
-    for ( std::string const& path : tuple ) {
-      p.pd.push_back(PersistenceDiagram(basepath + "/" + path));
+  std::vector<int64_t> ids ( sample_array . size () );
+  std::iota ( ids . begin (), ids . end (), 0 );
+  samples_ = loadPoints ( sample_array, basepath, ids, 
+                          diagram_store_filename_, &diagram_store_ );
+  for ( Point & point : samples_ ) distance_ . summarize ( &point );
+  //std::cout << "Finished loading samples.\n";
+  // The pivots of the partitions are the samples with ids 0, ..., K - 1
+  if ( num_partitions_ > samples_ . size () ) {
+    throw std::logic_error ( "--partition=k/K requires K to be at most the number of samples" );
+  }
+  if ( not incremental_filename . empty () ) {
+    json previous_json = readPrevious ( incremental_filename );
+    if ( previous_json . count ( "partition" ) ) {
+      throw std::logic_error ( incremental_filename + 
+                               " is the subsample of a partition; merge it first." );
+    }
+    previous_subsample_ = previous_json["subsample"] . get<std::vector<int64_t> > ();
+    if ( previous_json . count ( "nearest" ) ) {
+      previous_nearest_ = previous_json["nearest"] . get<std::vector<int64_t> > ();
+    } else if ( exact_nearest_ ) {
+      throw std::logic_error ( incremental_filename + 
+                               " has no nearest subsample points; use --nearest=witness." );
+    } else {
+      previous_nearest_ = previous_json["witness"] . get<std::vector<int64_t> > ();
+    }
+    if ( previous_nearest_ . size () > samples_ . size () ) {
+      throw std::logic_error ( incremental_filename + 
+                               " has more samples than " + samples_filename_ );
+    }
+  }
+  if ( not merge_filenames . empty () ) {
+    std::stringstream merge_stream ( merge_filenames );
+    std::string merge_filename;
+    merge_witness_ . assign ( samples_ . size (), -1 );
+    while ( std::getline ( merge_stream, merge_filename, ',' ) ) {
+      json partition_json = readPrevious ( merge_filename );
+      std::vector<int64_t> subsample = 
+        partition_json["subsample"] . get<std::vector<int64_t> > ();
+      std::vector<int64_t> witness = 
+        partition_json["witness"] . get<std::vector<int64_t> > ();
+      if ( witness . size () != samples_ . size () ) {
+        throw std::logic_error ( merge_filename + " has a different number of samples than " 
+                                 + samples_filename_ );
+      }
+      merge_subsample_ . insert ( merge_subsample_ . end (), 
+                                  subsample . begin (), subsample . end () );
+      for ( int64_t id = 0; id < witness . size (); ++ id ) {
+        if ( witness [ id ] != -1 ) merge_witness_ [ id ] = witness [ id ];
+      }
+    }
+    for ( int64_t id = 0; id < merge_witness_ . size (); ++ id ) {
+      if ( merge_witness_ [ id ] == -1 ) {
+        throw std::logic_error ( "The merged partitions do not cover sample " + 
+                                 std::to_string ( id ) );
+      }
     }
-    samples_.push_back(p);
   }
-  //std::cout << "Finished loading samples.\n";
   std::random_shuffle ( samples_ . begin (), samples_ . end () );
   //std::cout << "There are " << samples_ . size () << " samples.\n";
-  //std::cout << "Delta = " << delta_ << "\n";
+  //std::cout << "Delta = " << deltas_[0] << "\n";
   //std::cout << "Metric = " << metric_ << "\n";
 }
 
@@ -177,6 +751,26 @@ getCohortSize ( void ) const {
   return cohort_size_;
 }
 
+inline int64_t SubsampleConfig::
+getPartition ( void ) const {
+  return partition_;
+}
+
+inline int64_t SubsampleConfig::
+getNumPartitions ( void ) const {
+  return num_partitions_;
+}
+
+inline std::vector<int64_t> const& SubsampleConfig::
+getMergeSubsample ( void ) const {
+  return merge_subsample_;
+}
+
+inline std::vector<int64_t> const& SubsampleConfig::
+getMergeWitness ( void ) const {
+  return merge_witness_;
+}
+
 inline std::vector<Point> const& SubsampleConfig::
 getSamples ( void ) const {
   return samples_;
@@ -184,12 +778,137 @@ getSamples ( void ) const {
 
 inline double SubsampleConfig::
 getDelta ( void ) const {
-  return delta_;
+  return deltas_ [ 0 ];
+}
+
+inline std::vector<double> const& SubsampleConfig::
+getDeltas ( void ) const {
+  return deltas_;
+}
+
+inline double SubsampleConfig::
+getMetric ( void ) const {
+  return metric_;
+}
+
+inline std::string const& SubsampleConfig::
+getCheckpointFile ( void ) const {
+  return checkpoint_filename_;
+}
+
+inline double SubsampleConfig::
+getCheckpointInterval ( void ) const {
+  return checkpoint_interval_;
+}
+
+inline bool SubsampleConfig::
+getResume ( void ) const {
+  return resume_;
+}
+
+inline double SubsampleConfig::
+getTimeLimit ( void ) const {
+  return time_limit_;
+}
+
+inline std::string const& SubsampleConfig::
+getTelemetryFile ( void ) const {
+  return telemetry_filename_;
+}
+
+inline double SubsampleConfig::
+getTelemetryInterval ( void ) const {
+  return telemetry_interval_;
+}
+
+inline bool SubsampleConfig::
+getExactNearest ( void ) const {
+  return exact_nearest_;
+}
+
+inline int64_t SubsampleConfig::
+getSpeculationBudget ( void ) const {
+  return speculation_budget_;
+}
+
+inline int64_t SubsampleConfig::
+getCoordinatorThreads ( void ) const {
+  return coordinator_threads_;
+}
+
+inline double SubsampleConfig::
+getLocalDistanceTime ( void ) const {
+  return local_distance_time_;
+}
+
+inline int64_t SubsampleConfig::
+getBatchSize ( void ) const {
+  return batch_size_;
+}
+
+inline int64_t SubsampleConfig::
+getMaxBatchSize ( void ) const {
+  return max_batch_size_;
+}
+
+inline double SubsampleConfig::
+getStragglerFactor ( void ) const {
+  return straggler_factor_;
+}
+
+inline int64_t SubsampleConfig::
+getCacheMemory ( void ) const {
+  return cache_memory_;
+}
+
+inline std::string const& SubsampleConfig::
+getDistanceStore ( void ) const {
+  return distance_store_filename_;
+}
+
+inline double SubsampleConfig::
+getRelativeError ( void ) const {
+  return relative_error_;
+}
+
+inline std::vector<int64_t> const& SubsampleConfig::
+getPreviousSubsample ( void ) const {
+  return previous_subsample_;
+}
+
+inline std::vector<int64_t> const& SubsampleConfig::
+getPreviousNearest ( void ) const {
+  return previous_nearest_;
+}
+
+inline json SubsampleConfig::
+readPrevious ( std::string const& filename ) const {
+  std::ifstream previous_infile ( filename );
+  if ( not previous_infile ) {
+    throw std::runtime_error ( "Cannot open previous subsample " + filename );
+  }
+  json previous_json = json::parse ( previous_infile );
+  previous_infile . close ();
+  double previous_metric = previous_json["p"] . is_string () ? 
+    std::numeric_limits<double>::infinity() : (double) previous_json["p"];
+  double previous_delta = previous_json["delta"];
+  double previous_relative_error = previous_json . count ( "relative_error" ) ?
+    (double) previous_json["relative_error"] : 0.0;
+  if ( previous_delta != deltas_ [ 0 ] || 
+       not ( previous_metric == metric_ || 
+             ( std::isinf ( previous_metric ) && std::isinf ( metric_ ) ) ) ||
+       previous_relative_error != relative_error_ ) {
+    throw std::logic_error ( filename + 
+                             " was computed with a different delta, p or relative error." );
+  }
+  return previous_json;
 }
 
 inline void SubsampleConfig::
 handleResults ( std::vector<Point> const& results,
-                std::vector<int64_t> const& nearest ) const {
+                std::vector<int64_t> const& nearest,
+                std::vector<int64_t> const& witness,
+                int64_t level ) const {
   //std::cout << "There were " << results . size () 
   //          << " points in the subsample.\n";
   std::vector<int64_t> subsample_indices;
@@ -200,15 +919,35 @@ handleResults ( std::vector<Point> const& results,
 
   json output;
   output["sample"] = samples_filename_;
-  output["delta"] = delta_;
+  output["delta"] = deltas_ [ level ];
   if ( std::isinf ( metric_ ) ) {
     output["p"] = "inf";
   } else {
     output["p"] = metric_;
   }
+  if ( relative_error_ > 0.0 ) {
+    output["relative_error"] = relative_error_;
+  }
   output["subsample"] = subsample_indices;
-  output["nearest"] = nearest; // <-- ADDED LINE
-  std::ofstream ( subsample_filename_ ) << output;
+  if ( not nearest . empty () ) {
+    output["nearest"] = nearest; // <-- ADDED LINE
+  }
+  output["witness"] = witness;
+  if ( num_partitions_ > 1 ) {
+    output["partition"] = { partition_, num_partitions_ };
+  }
+  std::string filename = subsample_filename_;
+  if ( deltas_ . size () > 1 ) {
+    // e.g. /path/to/subsample.json becomes /path/to/subsample_10.json 
+    std::size_t dot = filename . find_last_of ( '.' );
+    std::size_t slash = filename . find_last_of ( '/' );
+    if ( dot == std::string::npos || 
+         ( slash != std::string::npos && dot < slash ) ) {
+      dot = filename . size ();
+    }
+    filename . insert ( dot, "_" + delta_strings_ [ level ] );
+  }
+  std::ofstream ( filename ) << output;
 #ifdef SUBSAMPLEDISTANCE_H
   //std::cout << "Distance calculations = " << global_distance_count << "\n";
 #endif
@@ -243,12 +982,47 @@ public:
   std::string const&
   getOutputFile ( void ) const;
 
+  /// getBatchSize
+  ///   Return the number of distances sent to a worker in one job,
+  ///   or 0 to adapt it to the measured latency
+  int64_t
+  getBatchSize ( void ) const;
+
+  /// getMaxBatchSize
+  ///   Return the largest number of distances sent to a worker in one 
+  ///   job when the batch size is adapted
+  int64_t
+  getMaxBatchSize ( void ) const;
+
+  /// getStragglerFactor
+  ///   Return the factor by which a job must exceed the mean job time
+  ///   to be sent again to an idle worker (0 to disable)
+  double
+  getStragglerFactor ( void ) const;
+
+  /// getDistanceStore
+  ///   Return the filename of the persistent distance store, or the
+  ///   empty string if there is none
+  std::string const&
+  getDistanceStore ( void ) const;
+
+  /// getMetric
+  ///   Return the metric p
+  double
+  getMetric ( void ) const;
+
 private:
   std::string distance_filename_;
+  std::string distance_store_filename_;
+  int64_t batch_size_;
+  int64_t max_batch_size_;
+  double straggler_factor_;
+  double relative_error_;
 
   double delta_;
   double metric_;
   Distance distance_;
+  boost::shared_ptr<PersistenceDiagramStore> diagram_store_;
   std::vector<Point> subsamples_;
 };
 
@@ -262,11 +1036,50 @@ DistanceMatrixConfig ( int argc, char * argv [] ) {
 
 inline void DistanceMatrixConfig::
 assign ( int argc, char * argv [] ) {
-  if ( argc != 3 ) {
-    std::cout << "Give two arguments: /path/to/subsample.json /path/to/distance.txt\n";
+  if ( argc < 3 ) {
+    std::cout << "Give two arguments: /path/to/subsample.json /path/to/distance.txt [options]\n";
     std::cout << " (Note: the second argument is the output file.)\n";
+    std::cout << " Options:\n";
+    std::cout << "  --diagram-store=/path/to/store    map the diagrams from a file shared by all\n";
+    std::cout << "                                    processes (e.g. in /dev/shm), built if need be\n";
+    std::cout << "  --batch-size=B|auto               send B distances to a worker per job, or adapt\n";
+    std::cout << "                                    to the network latency (default 1)\n";
+    std::cout << "  --max-batch-size=M                largest batch with --batch-size=auto (default 64)\n";
+    std::cout << "  --straggler-factor=F              send a job again to an idle worker if it takes\n";
+    std::cout << "                                    F times longer than expected (default 4; 0 = never)\n";
+    std::cout << "  --distance-store=/path/to/store   reuse and save distances in a file shared by runs\n";
+    std::cout << "  --relative-error=E                approximate Wasserstein distances within relative\n";
+    std::cout << "                                    error E by the auction algorithm (default 0, exact)\n";
     throw std::logic_error ( "Bad arguments." );
   }
+  std::string diagram_store_filename;
+  batch_size_ = 1;
+  max_batch_size_ = 64;
+  straggler_factor_ = 4.0;
+  relative_error_ = 0.0;
+  for ( int i = 3; i < argc; ++ i ) {
+    std::string arg = argv[i];
+    std::string key = arg . substr ( 0, arg . find ( '=' ) );
+    std::string value = ( key . size () < arg . size () ) ? arg . substr ( key . size () + 1 ) : "";
+    if ( key == "--diagram-store" ) {
+      diagram_store_filename = value;
+    } else if ( key == "--batch-size" ) {
+      batch_size_ = ( value == "auto" ) ? 0 : parseInteger ( key, value, 1 );
+    } else if ( key == "--max-batch-size" ) {
+      max_batch_size_ = parseInteger ( key, value, 1 );
+    } else if ( key == "--straggler-factor" ) {
+      straggler_factor_ = parseNumber ( key, value, 0.0 );
+    } else if ( key == "--distance-store" ) {
+      distance_store_filename_ = value;
+    } else if ( key == "--relative-error" ) {
+      relative_error_ = parseNumber ( key, value, 0.0 );
+    } else {
+      throw std::logic_error ( "Unrecognized option " + arg );
+    }
+  }
+  if ( relative_error_ > 0.0 && not distance_store_filename_ . empty () ) {
+    throw std::logic_error ( "--relative-error cannot be used with --distance-store" );
+  }
   //std::cout << "Loading subsamples...\n";
   std::string subsample_filename = argv[1];
   distance_filename_ = argv[2];
@@ -289,21 +1102,15 @@ assign ( int argc, char * argv [] ) {
   } catch ( ... ) {
     metric_ = std::numeric_limits<double>::infinity();
   }
-  for ( int64_t const& i : subsample_array ) {
-    Point p;
-    p . id = i;
-    json tuple = sample_array[i];
-    for ( std::string const& path : tuple ) {
-      p.pd.push_back(PersistenceDiagram(basepath + "/" + path));
-    }
-    subsamples_.push_back(p);
-  }
+  std::vector<int64_t> ids = subsample_array . get<std::vector<int64_t> > ();
+  subsamples_ = loadPoints ( sample_array, basepath, ids, 
+                             diagram_store_filename, &diagram_store_ );
   //std::cout << "Finished loading subsamples.\n";
 }
 
 inline Distance DistanceMatrixConfig::
 getDistanceFunctor ( void ) const {
-  return Distance ( metric_ );
+  return Distance ( metric_, relative_error_ );
 }
 
 inline std::vector<Point> const& DistanceMatrixConfig::
@@ -316,4 +1123,29 @@ getOutputFile ( void ) const {
   return distance_filename_;
 }
 
+inline int64_t DistanceMatrixConfig::
+getBatchSize ( void ) const {
+  return batch_size_;
+}
+
+inline int64_t DistanceMatrixConfig::
+getMaxBatchSize ( void ) const {
+  return max_batch_size_;
+}
+
+inline double DistanceMatrixConfig::
+getStragglerFactor ( void ) const {
+  return straggler_factor_;
+}
+
+inline std::string const& DistanceMatrixConfig::
+getDistanceStore ( void ) const {
+  return distance_store_filename_;
+}
+
+inline double DistanceMatrixConfig::
+getMetric ( void ) const {
+  return metric_;
+}
+
 #endif
@@ -10,47 +10,427 @@
 ///   and compute the result using the template class.
 ///   We require the Point class have a field "id" which distinguishes it
 ///   (presumably this can be its index in the sample)
+///   A distance may be requested with a "bound": the comparison it is
+///   needed for. The distance functor may then return a lower bound
+///   exceeding "bound" instead of the distance, which is cached as such
+///   and answers later requests with bounds below it.
 
 #ifndef SUBSAMPLEDISTANCE_H
 #define SUBSAMPLEDISTANCE_H
 
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <stdexcept>
 #include "boost/unordered_map.hpp"
+#include "boost/unordered_set.hpp"
 #include "boost/thread/mutex.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/optional.hpp"
+#include "subsample/DistanceStore.h"
 
-int64_t global_distance_count = 0;
+std::atomic<int64_t> global_distance_count ( 0 );
 
 template < class Point, class Distance >
 class SubsampleDistance {
 public:
-  SubsampleDistance ( void ) {}
-  SubsampleDistance ( Distance const& distance ) : distance_ ( distance ) {}
-  double compute ( Point const& p, Point const& q ) const {
-    return distance_ ( p, q );
+  SubsampleDistance ( void ) : capacity_ ( 0 ), hits_ ( 0 ), misses_ ( 0 ),
+    speculated_ ( 0 ), speculation_hits_ ( 0 ), evictions_ ( 0 ),
+    store_hits_ ( 0 ), filtered_ ( 0 ) {}
+  SubsampleDistance ( Distance const& distance ) 
+    : distance_ ( distance ), capacity_ ( 0 ), hits_ ( 0 ), misses_ ( 0 ),
+      speculated_ ( 0 ), speculation_hits_ ( 0 ), evictions_ ( 0 ),
+    store_hits_ ( 0 ), filtered_ ( 0 ) {}
+  /// compute
+  ///   Compute the distance between p and q, or a lower bound on it 
+  ///   exceeding "bound"
+  double compute ( Point const& p, Point const& q,
+                   double bound = std::numeric_limits<double>::infinity() ) const {
+    return distance_ ( p, q, bound );
   }
+  /// filter
+  ///   Return a lower bound on the distance between p and q exceeding 
+  ///   "bound", if the cheap bounds of the distance functor give one
+  ///   (then the distance need not be looked up or computed)
+  boost::optional<double> filter ( Point const& p, Point const& q, double bound ) {
+    if ( not ( bound < std::numeric_limits<double>::infinity() ) ) return boost::none;
+    double lower = distance_ . lower ( p, q );
+    if ( not ( lower > bound ) ) return boost::none;
+    ++ filtered_;
+    return lower;
+  }
+  /// cost
+  ///   Estimate the relative cost of computing a distance
+  double cost ( Point const& p, Point const& q ) const {
+    return distance_ . cost ( p, q );
+  }
+  /// operator ()
+  ///   Return the cached distance, or throw if it is not cached
   double operator () ( Point const& p, Point const& q ) {
+    boost::optional<double> result = probe ( p, q );
+    if ( not result ) throw 0;
+    return * result;
+  }
+  /// probe
+  ///   Return the cached distance, if it is cached (or in the 
+  ///   persistent store), or a cached lower bound on it exceeding
+  ///   "bound". Counts a hit or a miss, except that an operation
+  ///   reading a distance it waited for (see "wait") counts nothing:
+  ///   its request was counted as a miss.
+  boost::optional<double> probe ( Point const& p, Point const& q,
+                                  double bound = std::numeric_limits<double>::infinity() ) {
     //std::cout << " () Looking for point pair (" << p << ", " << q << ")\n";
     //std::cout << " () Looking for id pair (" << p.id << ", " << q.id << ")\n";
-    mutex_ . lock ();
-    Cache_t::iterator it = cache_ . find ( std::make_pair(p.id,q.id) );
-    if ( it == cache_ . end () ) { 
-      mutex_ . unlock ();
-      ++ global_distance_count;
-      throw 0;
+    uint64_t k = key ( p . id, q . id );
+    Shard & s = shard ( k );
+    s . mutex . lock ();
+    bool waited;
+    boost::optional<double> result = find ( s, k, p . id, q . id, bound, &waited );
+    s . mutex . unlock ();
+    if ( not result ) { ++ misses_; ++ global_distance_count; }
+    else if ( not waited ) ++ hits_;
+    return result;
+  }
+  /// wait
+  ///   Register operation "n" as waiting for the distance between
+  ///   "p" and "q", which it found missing. Return 1 if it is the 
+  ///   first (the distance should be requested), 0 if the distance has
+  ///   already been requested, and 2 if it has been cached since (the
+  ///   operation need not wait). Waiting operations are returned by
+  ///   "cache" or "speculate" when the distance arrives, and probe 
+  ///   again: one requested with a lower bound may have to wait again.
+  ///   Until they have, the distance is pinned (not evicted).
+  int wait ( Point const& p, Point const& q, int64_t n,
+             double bound = std::numeric_limits<double>::infinity() ) {
+    uint64_t k = key ( p . id, q . id );
+    Shard & s = shard ( k );
+    s . mutex . lock ();
+    int result;
+    typename Cache_t::iterator it = s . cache . find ( k );
+    if ( it != s . cache . end () && it -> second . answers ( bound ) ) {
+      ++ it -> second . pins;
+      result = 2;
+    } else {
+      std::vector<int64_t> & waiting = s . pending [ k ];
+      result = waiting . empty () ? 1 : 0;
+      waiting . push_back ( n );
+    }
+    s . mutex . unlock ();
+    return result;
+  }
+  /// cache
+  ///   Cache a distance computed with "bound" (so a lower bound if it
+  ///   exceeds "bound"). Return the operations waiting for it.
+  std::vector<int64_t> cache ( Point const& p, Point const& q, double dist,
+                               double bound = std::numeric_limits<double>::infinity() ) {
+    return cache ( p . id, q . id, dist, bound );
+  }
+  std::vector<int64_t> cache ( int64_t p, int64_t q, double dist,
+                               double bound = std::numeric_limits<double>::infinity() ) {
+    uint64_t k = key ( p, q );
+    bool exact = not ( dist > bound );
+    Shard & s = shard ( k );
+    s . mutex . lock ();
+    std::pair<typename Cache_t::iterator, bool> inserted = 
+      s . cache . insert ( std::make_pair ( k, Entry () ) );
+    Entry & entry = inserted . first -> second;
+    // A distance is not replaced by a lower bound, nor a lower bound by
+    // a smaller one
+    if ( inserted . second || ( exact && not entry . exact ) || 
+         ( not entry . exact && dist > entry . distance ) ) {
+      entry . distance = dist;
+      entry . exact = exact;
+    }
+    entry . referenced = true;
+    std::vector<int64_t> waiting = release ( s, k );
+    if ( capacity_ > 0 && s . cache . size () > capacity_ ) evict ( s );
+    s . mutex . unlock ();
+    if ( store_ && exact ) store_ -> insert ( hashes_ [ p ], hashes_ [ q ], dist );
+    return waiting;
+  }
+  /// speculate
+  ///   Cache a distance which was computed before it was requested.
+  ///   Return the operations which have since begun waiting for it.
+  std::vector<int64_t> speculate ( int64_t p, int64_t q, double dist ) {
+    uint64_t k = key ( p, q );
+    Shard & s = shard ( k );
+    s . mutex . lock ();
+    Entry entry;
+    entry . distance = dist;
+    entry . exact = true;
+    entry . referenced = false;
+    entry . pins = 0;
+    std::pair<typename Cache_t::iterator, bool> result = 
+      s . cache . insert ( std::make_pair ( k, entry ) );
+    bool inserted = result . second;
+    // The distance replaces a lower bound on it
+    if ( not inserted && not result . first -> second . exact ) {
+      result . first -> second . distance = dist;
+      result . first -> second . exact = true;
+    }
+    std::vector<int64_t> waiting = release ( s, k );
+    // A distance already waited for is not speculative
+    if ( inserted && waiting . empty () ) s . speculative . insert ( k );
+    if ( capacity_ > 0 && s . cache . size () > capacity_ ) evict ( s );
+    s . mutex . unlock ();
+    if ( inserted ) ++ speculated_;
+    if ( inserted && not waiting . empty () ) ++ speculation_hits_;
+    if ( store_ ) store_ -> insert ( hashes_ [ p ], hashes_ [ q ], dist );
+    return waiting;
+  }
+  /// cached
+  ///   Return true if the distance, or a lower bound on it exceeding
+  ///   "bound", is in the cache (without counting a hit or a miss)
+  bool cached ( int64_t p, int64_t q, 
+                double bound = std::numeric_limits<double>::infinity() ) const {
+    uint64_t k = key ( p, q );
+    Shard const& s = shard ( k );
+    s . mutex . lock ();
+    typename Cache_t::const_iterator it = s . cache . find ( k );
+    bool result = it != s . cache . end () && it -> second . answers ( bound );
+    s . mutex . unlock ();
+    double stored;
+    if ( not result && store_ ) {
+      result = store_ -> find ( hashes_ [ p ], hashes_ [ q ], &stored );
+    }
+    return result;
+  }
+  /// entries
+  ///   Report the cached distances as parallel arrays of
+  ///   (p.id, q.id, distance), with p.id < q.id, leaving out lower 
+  ///   bounds. Used for checkpointing.
+  void entries ( std::vector<int64_t> * p, 
+                 std::vector<int64_t> * q, 
+                 std::vector<double> * dist ) const {
+    for ( Shard const& s : shards_ ) {
+      s . mutex . lock ();
+      for ( typename Cache_t::const_iterator it = s . cache . begin (); 
+            it != s . cache . end (); ++ it ) {
+        if ( not it -> second . exact ) continue;
+        p -> push_back ( (int64_t) ( it -> first >> 32 ) );
+        q -> push_back ( (int64_t) ( it -> first & 0xFFFFFFFFULL ) );
+        dist -> push_back ( it -> second . distance );
+      }
+      s . mutex . unlock ();
+    }
+  }
+  /// store
+  ///   Look up distances missing from the cache in the persistent 
+  ///   "store", and add the distances cached to it. "hashes" is
+  ///   indexed by point id (see Point::hash).
+  void store ( boost::shared_ptr<DistanceStore> store, 
+               std::vector<uint64_t> const& hashes ) {
+    store_ = store;
+    hashes_ = hashes;
+  }
+  /// flush
+  ///   Write the distances added to the persistent store
+  void flush ( void ) {
+    if ( store_ ) store_ -> flush ();
+  }
+  /// stored
+  ///   Return the number of lookups answered from the persistent store
+  int64_t stored ( void ) const {
+    return store_hits_;
+  }
+  /// limit
+  ///   Bound the memory used by the cache to about "bytes" 
+  ///   (0 for no bound). When it is full, distances are evicted,
+  ///   those not used recently and farthest from the root of the
+  ///   tree first.
+  void limit ( int64_t bytes ) {
+    capacity_ = bytes / entry_bytes_ / num_shards_;
+    if ( bytes > 0 && capacity_ < 16 ) capacity_ = 16;
+  }
+  /// depth
+  ///   Record the depth of point "id" in the metric tree (0 for the
+  ///   root). Distances to points near the root are used by every
+  ///   search, so they are kept longest. Points not in the tree 
+  ///   (queries) have no depth.
+  void depth ( int64_t id, int64_t depth ) {
+    depth_mutex_ . lock ();
+    depths_ [ id ] = depth;
+    depth_mutex_ . unlock ();
+  }
+  /// depth
+  ///   Return the depth recorded for point "id", or -1 if none
+  int64_t depth ( int64_t id ) const {
+    depth_mutex_ . lock ();
+    boost::unordered_map<int64_t, int64_t>::const_iterator it = depths_ . find ( id );
+    int64_t result = ( it == depths_ . end () ) ? -1 : it -> second;
+    depth_mutex_ . unlock ();
+    return result;
+  }
+  /// size
+  ///   Return the number of cached distances
+  int64_t size ( void ) const {
+    int64_t result = 0;
+    for ( Shard const& s : shards_ ) {
+      s . mutex . lock ();
+      result += s . cache . size ();
+      s . mutex . unlock ();
     }
-    mutex_ . unlock ();
-    return it -> second;
+    return result;
+  }
+  /// evictions
+  ///   Return the number of distances evicted from the cache
+  int64_t evictions ( void ) const {
+    return evictions_;
+  }
+  /// statistics
+  ///   Report the number of lookups which were answered 
+  ///   from the cache (hits) and which were not (misses). A distance
+  ///   which had to be waited for counts only as a miss.
+  void statistics ( int64_t * hits, int64_t * misses ) const {
+    * hits = hits_;
+    * misses = misses_;
   }
-  void cache ( Point const& p, Point const& q, double dist ) {
-    mutex_ . lock ();
-    cache_ [ std::make_pair(p.id,q.id) ] = dist;
-    mutex_ . unlock ();
+  /// filtered
+  ///   Return the number of comparisons decided by "filter"
+  int64_t filtered ( void ) const {
+    return filtered_;
+  }
+  /// speculation
+  ///   Report the number of speculative distances cached 
+  ///   and how many of them have since been looked up
+  void speculation ( int64_t * speculated, int64_t * used ) const {
+    * speculated = speculated_;
+    * used = speculation_hits_;
   }
 private:
-  typedef boost::unordered_map<std::pair<int64_t, int64_t>, double> Cache_t;
-  Cache_t cache_;
-  boost::mutex mutex_;
+  // Distances are symmetric, so the pair (p,q) is cached under the
+  // key min(p,q) << 32 | max(p,q). Keys are spread over shards, each
+  // with its own lock, so concurrent lookups rarely contend.
+  struct Entry {
+    double distance;
+    bool exact; // or a lower bound on the distance
+    bool referenced; // used since the last eviction
+    int64_t pins; // released waiters which have not read it yet
+    /// answers
+    ///   Whether the entry decides a comparison with "bound"
+    bool answers ( double bound ) const {
+      return exact || distance > bound;
+    }
+  };
+  typedef boost::unordered_map<uint64_t, Entry> Cache_t;
+  struct Shard {
+    Cache_t cache;
+    boost::unordered_set<uint64_t> speculative; // not yet used
+    boost::unordered_map<uint64_t, std::vector<int64_t> > pending; // waiting operations
+    mutable boost::mutex mutex;
+  };
+  static const int64_t num_shards_ = 64;
+  static const int64_t entry_bytes_ = 64; // estimate, including hash table overhead
+  Shard shards_ [ num_shards_ ];
   Distance distance_;
+  uint64_t capacity_; // maximum entries per shard, or 0 for no maximum
+  boost::unordered_map<int64_t, int64_t> depths_; // by point id
+  mutable boost::mutex depth_mutex_;
+  std::atomic<int64_t> hits_;
+  std::atomic<int64_t> misses_;
+  std::atomic<int64_t> speculated_;
+  std::atomic<int64_t> speculation_hits_;
+  std::atomic<int64_t> evictions_;
+  std::atomic<int64_t> store_hits_;
+  std::atomic<int64_t> filtered_;
+  boost::shared_ptr<DistanceStore> store_;
+  std::vector<uint64_t> hashes_; // by point id
+
+  static uint64_t key ( int64_t p, int64_t q ) {
+    if ( p < 0 || q < 0 || p > 0xFFFFFFFFLL || q > 0xFFFFFFFFLL ) {
+      throw std::logic_error ( "SubsampleDistance. Point ids must be in [0, 2^32)." );
+    }
+    if ( q < p ) std::swap ( p, q );
+    return ( (uint64_t) p << 32 ) | (uint64_t) q;
+  }
+  /// find
+  ///   Look up key "k" (of ids "p" and "q") in the (locked) shard "s",
+  ///   then in the persistent store. A cached lower bound is returned
+  ///   only if it exceeds "bound". Set "waited" if the entry was pinned
+  ///   (read by an operation which waited for it).
+  boost::optional<double> find ( Shard & s, uint64_t k, int64_t p, int64_t q, 
+                                 double bound, bool * waited ) {
+    typename Cache_t::iterator it = s . cache . find ( k );
+    // A released waiter reading the distance it waited for unpins it
+    * waited = ( it != s . cache . end () && it -> second . pins > 0 );
+    if ( * waited ) -- it -> second . pins;
+    if ( it != s . cache . end () && it -> second . answers ( bound ) ) {
+      it -> second . referenced = true;
+      if ( not s . speculative . empty () && s . speculative . erase ( k ) ) {
+        ++ speculation_hits_;
+      }
+      return it -> second . distance;
+    }
+    double stored;
+    if ( store_ && store_ -> find ( hashes_ [ p ], hashes_ [ q ], &stored ) ) {
+      Entry & entry = s . cache [ k ];
+      entry . distance = stored;
+      entry . exact = true;
+      entry . referenced = true;
+      entry . pins = 0;
+      if ( capacity_ > 0 && s . cache . size () > capacity_ ) evict ( s );
+      ++ store_hits_;
+      return stored;
+    }
+    return boost::none;
+  }
+  /// release
+  ///   Remove and return the operations waiting for key "k" in the
+  ///   (locked) shard "s", pinning its entry until they have read it
+  std::vector<int64_t> release ( Shard & s, uint64_t k ) {
+    std::vector<int64_t> waiting;
+    typename boost::unordered_map<uint64_t, std::vector<int64_t> >::iterator it = 
+      s . pending . find ( k );
+    if ( it != s . pending . end () ) {
+      waiting . swap ( it -> second );
+      s . pending . erase ( it );
+      s . cache [ k ] . pins += waiting . size ();
+    }
+    return waiting;
+  }
+  /// evict
+  ///   Evict a tenth of the entries of the (locked) shard "s": first
+  ///   those not used since the last eviction, and among them those 
+  ///   whose points are deepest in the tree (or not in it). Pinned
+  ///   entries are kept.
+  void evict ( Shard & s ) {
+    std::vector<std::pair<std::pair<bool, int64_t>, uint64_t> > order;
+    order . reserve ( s . cache . size () );
+    depth_mutex_ . lock ();
+    for ( typename Cache_t::const_iterator it = s . cache . begin (); 
+          it != s . cache . end (); ++ it ) {
+      if ( it -> second . pins > 0 ) continue;
+      int64_t depth = std::min ( depthOf ( it -> first >> 32 ), 
+                                 depthOf ( it -> first & 0xFFFFFFFFULL ) );
+      order . push_back ( std::make_pair ( 
+        std::make_pair ( it -> second . referenced, -depth ), it -> first ) );
+    }
+    depth_mutex_ . unlock ();
+    int64_t count = s . cache . size () - ( 9 * capacity_ ) / 10;
+    count = std::max<int64_t> ( 0, std::min<int64_t> ( count, order . size () ) );
+    std::nth_element ( order . begin (), order . begin () + count, order . end () );
+    for ( int64_t i = 0; i < count; ++ i ) {
+      s . cache . erase ( order [ i ] . second );
+      s . speculative . erase ( order [ i ] . second );
+    }
+    evictions_ += count;
+    for ( typename Cache_t::iterator it = s . cache . begin (); 
+          it != s . cache . end (); ++ it ) {
+      it -> second . referenced = false;
+    }
+  }
+  int64_t depthOf ( int64_t id ) const {
+    boost::unordered_map<int64_t, int64_t>::const_iterator it = depths_ . find ( id );
+    return ( it == depths_ . end () ) ? std::numeric_limits<int64_t>::max () : it -> second;
+  }
+  Shard & shard ( uint64_t k ) {
+    return shards_ [ ( ( k * 0x9E3779B97F4A7C15ULL ) >> 32 ) % num_shards_ ];
+  }
+  Shard const& shard ( uint64_t k ) const {
+    return shards_ [ ( ( k * 0x9E3779B97F4A7C15ULL ) >> 32 ) % num_shards_ ];
+  }
 };
 
 #endif
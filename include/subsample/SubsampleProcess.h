@@ -9,14 +9,63 @@
 #include <exception>
 #include <stdexcept>
 #include <numeric>
+#include <limits>
+#include <queue>
+#include <deque>
+#include <map>
+#include <chrono>
 #include "boost/foreach.hpp"
 #include "boost/shared_ptr.hpp"
 #include "boost/thread/thread.hpp"
 #include "boost/thread/mutex.hpp"
+#include "boost/unordered_set.hpp"
+#include "boost/functional/hash.hpp"
 #include "SubsampleConfig.h"
+#include "SubsampleCheckpoint.h"
+#include "SubsampleTelemetry.h"
+#include "SubsampleBatch.h"
 
 #include "delegator/delegator.h"
 
+/// SubsampleWorkItem
+///   A distance requested by operation "n" of a stage. Items are served
+///   first by stage (older first), then by depth (the number of times
+///   the operation has already waited for distances, so operations deep
+///   into their traversal, which hold up the end of the stage, go first),
+///   then in the order they were requested. The distance is only compared
+///   with "bound", so a lower bound exceeding it will do (see 
+///   MetricTree::getDistance).
+template < class T >
+struct SubsampleWorkItem {
+  int64_t n;
+  std::pair<T,T> points;
+  double bound;
+  int64_t stage;
+  int64_t depth;
+  int64_t sequence;
+  bool operator < ( SubsampleWorkItem const& rhs ) const {
+    // std::priority_queue serves the greatest item
+    if ( stage != rhs . stage ) return stage > rhs . stage;
+    if ( depth != rhs . depth ) return depth < rhs . depth;
+    return sequence > rhs . sequence;
+  }
+};
+
+/// SubsampleOutstanding
+///   A requested distance which has been sent to a worker and not yet
+///   received, with the time it was sent and the time the job it was
+///   sent in is expected to take (from sending it to receiving its 
+///   result). If it takes much longer (the worker is slow, or the 
+///   diagrams are unusually large) it is sent again to an idle worker,
+///   and the first result received is used.
+template < class T >
+struct SubsampleOutstanding {
+  SubsampleWorkItem<T> item;
+  std::chrono::steady_clock::time_point issued;
+  double expected;
+  bool duplicated;
+};
+
 template < class T, class D >
 class SubsampleProcess : public Coordinator_Worker_Process {
 public:
@@ -31,33 +80,63 @@ private:
   char ** argv_;
   MetricTree<T,D> mt_;
   std::vector<T> samples_;
-  double delta_;
+  std::vector<double> deltas_;
   std::stack<int64_t> ready_;
   boost::mutex mutex_;
   boost::shared_ptr<D> distance_;
   bool all_done_;
-  std::stack<std::pair<int64_t,std::pair<T,T> > > work_items_;
+  std::priority_queue<SubsampleWorkItem<T> > work_items_;
   boost::shared_ptr<boost::thread> thread_ptr;
   mutable int64_t time_delay_;
   int64_t cohort_size_;
   SubsampleConfig config_;
-  std::vector<int64_t> nearest_; // index of nearest subsample
+  std::vector<SubsampleLevel> levels_; // results, per level
+  SubsampleCheckpoint checkpoint_;
+  int64_t start_; // position in samples_ to resume from
+  SubsampleTelemetry telemetry_;
+  std::vector<int64_t> seeds_; // positions in samples_ of a previous subsample
+  int64_t num_previous_; // samples_[0,num_previous_) were handled by a previous run
+  std::vector<int64_t> store_; // position in config_ . getSamples () by id
+  std::deque<std::pair<T,T> > speculative_; // distances predicted to be needed
+  int64_t speculation_budget_; // remaining speculative distances
+  double local_cost_; // distances of lower cost are computed by the coordinator
+  SubsampleBatch batch_size_; // number of distances per job
+  std::map<int64_t, SubsampleOutstanding<T> > outstanding_; // by sequence
+  double straggler_factor_; // duplicate jobs taking this many times longer than expected
+  double completed_seconds_; // total round trip time of jobs computed by workers
+  int64_t completed_; // number of distances in these jobs
+  int64_t num_merge_; // samples_[0,num_merge_) are the subsamples being merged
+  bool stopped_; // the run stopped at the time limit, without results
+  void report ( bool force = false );
+  void calibrate ( void );
+  T const& point ( int64_t id ) const;
 };
 
+/// AspirationFunctor
+///   Returns (id, distance) of a point within delta 
+///   (the "witness"), or (-1, inf) if there is none.
 template < class T, class D >
 class AspirationFunctor {
 public:
-  typedef bool ReturnType;
+  typedef std::pair<int64_t, double> ReturnType;
   typedef typename MetricTree<T,D>::AspirationException Exception;
+  static const bool concurrent = true;
   AspirationFunctor ( MetricTree<T,D> * mt, 
                       std::vector<T> const& samples, 
                       double delta ) 
     : mt_(mt), samples_(samples), delta_(delta) {}
   ReturnType operator () ( int64_t i ) { 
-    return ( mt_ -> aspiration ( samples_ [ i ], delta_ ) == mt_ -> end () ); 
+    Exception e;
+    e . x . reset ( new T ( samples_ [ i ] ) );
+    e . delta = delta_;
+    return (*this) ( e );
   }
   ReturnType operator () ( Exception & e ) { 
-    return ( mt_ -> aspiration ( e ) == mt_ -> end () ); 
+    typename MetricTree<T,D>::iterator it = mt_ -> aspiration ( e );
+    if ( it == mt_ -> end () ) {
+      return ReturnType ( -1, std::numeric_limits<double>::infinity() );
+    }
+    return ReturnType ( it -> id, e . distances -> front () );
   }
 private:
   MetricTree<T,D> * mt_;
@@ -70,6 +149,7 @@ class InsertFunctor {
 public:
   typedef int64_t ReturnType;
   typedef typename MetricTree<T,D>::InsertException Exception;
+  static const bool concurrent = false; // modifies the tree
   InsertFunctor ( MetricTree<T,D> * mt, 
                   std::vector<T> const& samples )
     : mt_(mt), samples_(samples) {}
@@ -84,20 +164,31 @@ private:
   std::vector<T> const& samples_;
 };
 
+/// DeltaCloseFunctor
+///   Returns the points within delta, with their distances
 template < class T, class D >
 class DeltaCloseFunctor {
 public:
-  typedef std::vector< typename MetricTree<T,D>::iterator> ReturnType;
+  typedef std::vector< std::pair<typename MetricTree<T,D>::iterator, double> > ReturnType;
   typedef typename MetricTree<T,D>::DeltaCloseException Exception;
+  static const bool concurrent = true;
   DeltaCloseFunctor ( MetricTree<T,D> * mt, 
                       std::vector<T> const& samples, 
                       double delta ) 
     : mt_(mt), samples_(samples), delta_(delta) {}
   ReturnType operator () ( int64_t i ) { 
-    return mt_ -> deltaClose ( samples_ [ i ], delta_); 
+    Exception e;
+    e . x . reset ( new T ( samples_ [ i ] ) );
+    e . delta = delta_;
+    return (*this) ( e );
   }
   ReturnType operator () ( Exception & e ) { 
-    return mt_ -> deltaClose ( e ); 
+    std::vector<typename MetricTree<T,D>::iterator> close = mt_ -> deltaClose ( e ); 
+    ReturnType result;
+    for ( int64_t j = 0; j < close . size (); ++ j ) {
+      result . push_back ( std::make_pair ( close [ j ], (* e . distances) [ j ] ) );
+    }
+    return result;
   }
 private:
   MetricTree<T,D> * mt_;
@@ -110,15 +201,64 @@ class NearestNeighborFunctor {
 public:
   typedef typename MetricTree<T,D>::iterator ReturnType;
   typedef typename MetricTree<T,D>::NearestException Exception;
+  static const bool concurrent = true;
   NearestNeighborFunctor ( MetricTree<T,D> * mt, 
-                      std::vector<T> const& samples) 
-    : mt_(mt), samples_(samples) {}
+                      std::vector<T> const& samples,
+                      double bound = std::numeric_limits<double>::infinity() ) 
+    : mt_(mt), samples_(samples), bound_(bound), bounds_(NULL) {}
+  /// Search only for points closer than bounds [ i ] to samples [ i ]
+  NearestNeighborFunctor ( MetricTree<T,D> * mt, 
+                      std::vector<T> const& samples,
+                      std::vector<double> const& bounds ) 
+    : mt_(mt), samples_(samples), bounds_(&bounds) {}
   ReturnType operator () ( int64_t i ) { 
-    return mt_ -> nearest ( samples_ [ i ] ); 
+    return mt_ -> nearest ( samples_ [ i ], bounds_ ? (*bounds_) [ i ] : bound_ ); 
   }
   ReturnType operator () ( Exception & e ) { 
     return mt_ -> nearest ( e ); 
   }
+private:
+  MetricTree<T,D> * mt_;
+  std::vector<T> const& samples_;
+  double bound_;
+  std::vector<double> const* bounds_;
+};
+
+/// PivotFunctor
+///   Returns the id of the nearest point in a tree of pivots (the
+///   smallest id if there is a tie), so that every run assigns
+///   a sample to the same pivot
+template < class T, class D >
+class PivotFunctor {
+public:
+  typedef int64_t ReturnType;
+  typedef typename MetricTree<T,D>::KNearestException Exception;
+  static const bool concurrent = true;
+  PivotFunctor ( MetricTree<T,D> * mt, 
+                 std::vector<T> const& samples ) 
+    : mt_(mt), samples_(samples) {}
+  ReturnType operator () ( int64_t i ) { 
+    Exception e;
+    e . x . reset ( new T ( samples_ [ i ] ) );
+    e . k = mt_ -> size ();
+    return (*this) ( e );
+  }
+  ReturnType operator () ( Exception & e ) { 
+    // Searching for all of the pivots finds every distance (the search
+    // keeps them, so they need not be looked up again)
+    mt_ -> knearest ( e );
+    int64_t best_id = -1;
+    double best = std::numeric_limits<double>::infinity();
+    for ( std::pair<double, int64_t> const& pivot : e . best ) {
+      int64_t id = mt_ -> node ( pivot . second ) -> id;
+      if ( best_id == -1 || pivot . first < best || 
+           ( pivot . first == best && id < best_id ) ) {
+        best = pivot . first;
+        best_id = id;
+      }
+    }
+    return best_id;
+  }
 private:
   MetricTree<T,D> * mt_;
   std::vector<T> const& samples_;
@@ -128,172 +268,492 @@ template < class T, class D >
 class SubsampleThread {
 public:
   SubsampleThread ( MetricTree<T,D> * mt,
-                    std::vector<int64_t> * nearest,
-                    std::vector<T> const& samples, 
-                    double delta, 
+                    std::vector<SubsampleLevel> * levels,
+                    std::vector<T> & samples, 
+                    std::vector<double> const& deltas, 
                     std::stack<int64_t> * ready, 
                     boost::mutex * mutex,
                     bool * all_done, 
-                    std::stack<std::pair<int64_t,std::pair<T,T > > > * work_items,
+                    std::priority_queue<SubsampleWorkItem<T> > * work_items,
                     boost::shared_ptr<D> distance, 
-                    int64_t cohort_size ) 
-    : mt_(mt), nearest_(nearest), samples_(samples), delta_(delta), 
+                    int64_t cohort_size,
+                    SubsampleCheckpoint * checkpoint,
+                    int64_t start,
+                    SubsampleTelemetry * telemetry,
+                    std::vector<int64_t> const& seeds,
+                    int64_t num_previous,
+                    bool exact_nearest,
+                    std::deque<std::pair<T,T> > * speculative,
+                    int64_t num_threads,
+                    double local_cost,
+                    int64_t partition,
+                    int64_t num_partitions,
+                    std::vector<int64_t> const& merge_witness,
+                    int64_t num_merge,
+                    double time_limit,
+                    bool * stopped ) 
+    : mt_(mt), levels_(levels), deltas_(deltas), samples_(samples), 
       ready_(ready), mutex_(mutex), all_done_(all_done), 
-      work_items_(work_items), distance_(distance), cohort_size_(cohort_size) {}
+      work_items_(work_items), stage_sequence_(0), request_sequence_(0),
+      distance_(distance), cohort_size_(cohort_size),
+      checkpoint_(checkpoint), start_(start), telemetry_(telemetry),
+      seeds_(seeds), num_previous_(num_previous), exact_nearest_(exact_nearest),
+      speculative_(speculative), num_threads_(num_threads), 
+      local_cost_(local_cost), partition_(partition), 
+      num_partitions_(num_partitions), merge_witness_(merge_witness),
+      num_merge_(num_merge), num_depths_(0), time_limit_(time_limit),
+      stopped_(stopped) {}
   void operator () ( void );
   template < class FunctionObject > void
   parallel ( std::vector<typename FunctionObject::ReturnType> * results,
              std::vector<int64_t> const& arguments,
              FunctionObject & F );
+  /// speculate
+  ///   Replace the speculative distances with those between the
+  ///   samples [N, N + cohort_size_) and the top levels of the tree,
+  ///   which the aspiration searches of the next cohort begin with
+  void speculate ( int64_t N );
 private:
   MetricTree<T,D> * mt_;
-  std::vector<int64_t> * nearest_;
-  double delta_;
-  std::vector<T> const& samples_;
+  std::vector<SubsampleLevel> * levels_;
+  std::vector<double> deltas_;
+  double delta_; // delta of the current level
+  std::vector<T> & samples_;
   std::stack<int64_t> * ready_;
   boost::mutex * mutex_;
   bool * all_done_;
-  std::stack<std::pair<int64_t,std::pair<T,T > > > * work_items_;
+  std::priority_queue<SubsampleWorkItem<T> > * work_items_;
+  int64_t stage_sequence_; // number of calls to parallel
+  int64_t request_sequence_; // number of distances requested
   boost::shared_ptr<D> distance_;
-  int64_t time_delay_;
   int64_t cohort_size_;
+  SubsampleCheckpoint * checkpoint_;
+  int64_t start_;
+  SubsampleTelemetry * telemetry_;
+  std::vector<int64_t> seeds_;
+  int64_t num_previous_;
+  bool exact_nearest_;
+  std::deque<std::pair<T,T> > * speculative_;
+  int64_t num_threads_; // for concurrent operations in parallel
+  double local_cost_; // distances of lower cost are computed here
+  int64_t partition_;
+  int64_t num_partitions_;
+  std::vector<int64_t> merge_witness_; // by id, from the merged partitions
+  int64_t num_merge_; // samples_[0,num_merge_) are the merged subsamples
+  int64_t num_depths_; // number of tree nodes whose depth has been recorded
+  double time_limit_; // seconds after which the run stops at a cohort boundary
+  bool * stopped_; // set if the run stopped at the time limit
+
+  /// depths
+  ///   Record in the distance cache the depth of the tree nodes 
+  ///   inserted since the last call, which guides its evictions
+  void depths ( void );
+
+  /// partition
+  ///   Move the samples of partition_ to the front of samples_ and
+  ///   return their number. A sample belongs to the partition of the
+  ///   nearest pivot, where the pivots are the samples with ids 
+  ///   0, ..., num_partitions_ - 1.
+  int64_t partition ( void );
+
+  /// resolve
+  ///   Called when the merged subsamples samples_[0,num_merge_) have
+  ///   been processed. A later sample needs processing only if its
+  ///   witness (within its partition) was not kept; these are moved
+  ///   to just after the merged subsamples. The others get their
+  ///   witness from the partition, which is within delta (its 
+  ///   distance is not known, so delta bounds the nearest search).
+  ///   Return the end of the samples which need processing.
+  int64_t resolve ( SubsampleLevel & result );
 };
 
 template < class T, class D >
 void SubsampleThread<T,D>::
 operator () ( void ) {
   typedef typename MetricTree<T,D>::iterator iterator;
-  int64_t N = 0;
-  while ( N < samples_ . size () ) {
-    // Stage 1. Aspiration Search Stage (identify candidates)
-    //std::cout << "Stage 1. N = " << N << "\n";
-    //std::cout << "cohort_size_ = " << cohort_size_ << "\n";
-    std::vector<int64_t> candidates;
-    /* Stage 1 */ {
-      AspirationFunctor<T,D> functor ( mt_, samples_, delta_ );
-      while ( N < samples_ . size () && candidates . size () < cohort_size_ ) {
+  int64_t N = start_;
+  int64_t cohort = 0;
+  int64_t NumSamples = samples_ . size ();
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now ();
+  depths ();
+  // Seed the tree with the subsample of a previous run (unless restored
+  // from a checkpoint). It is delta-sparse and delta-dense for the
+  // first num_previous_ samples, so the cohorts begin after them; if
+  // there are no new samples it is the result.
+  if ( mt_ -> size () == 0 && not seeds_ . empty () ) {
+    telemetry_ -> stage ( 5, cohort, N );
+    InsertFunctor<T,D> functor ( mt_, samples_ );
+    std::vector<int64_t> results;
+    parallel ( &results, seeds_, functor );
+    depths ();
+  }
+  // Each level refines the subsample of the previous (coarser) level,
+  // which is also delta-sparse for the smaller delta. The tree and the 
+  // distance cache are shared between the levels.
+  for ( int64_t level = 0; level < deltas_ . size (); ++ level ) {
+    SubsampleLevel & result = (*levels_) [ level ];
+    if ( result . size >= 0 ) continue; // restored from a checkpoint
+    delta_ = deltas_ [ level ];
+    telemetry_ -> level ( level, delta_ );
+    int64_t offset = level * NumSamples; // for progress reports
+    std::vector<int64_t> & nearest = result . nearest;
+    std::vector<int64_t> & witness = result . witness;
+    std::vector<double> & witness_distance = result . witness_distance;
+    if ( witness . empty () ) {
+      witness . resize ( NumSamples, -1 );
+      witness_distance . resize ( NumSamples, 
+                                  std::numeric_limits<double>::infinity() );
+    }
+    // Record "w" as a witness for sample "i" if it is closer than the last
+    auto record = [&] ( int64_t i, int64_t w, double dist ) {
+      int64_t id = samples_ [ i ] . id;
+      if ( dist < witness_distance [ id ] ) {
+        witness [ id ] = w;
+        witness_distance [ id ] = dist;
+      }
+    };
+    // The cohorts process samples_ [ 0, end )
+    int64_t end = NumSamples;
+    if ( num_partitions_ > 1 ) end = partition ();
+    bool merging = not merge_witness_ . empty ();
+    if ( merging ) end = ( N < num_merge_ ) ? num_merge_ : resolve ( result );
+    while ( N < end ) {
+      // Stage 1. Aspiration Search Stage (identify candidates)
+      //std::cout << "Stage 1. N = " << N << "\n";
+      //std::cout << "cohort_size_ = " << cohort_size_ << "\n";
+      std::vector<int64_t> candidates;
+      /* Stage 1 */ {
+        AspirationFunctor<T,D> functor ( mt_, samples_, delta_ );
+        while ( N < end && candidates . size () < cohort_size_ ) {
+          telemetry_ -> stage ( 1, cohort, offset + N );
+          std::vector<int64_t> arguments;
+          while ( N < end && arguments . size () < cohort_size_ ) {
+            arguments . push_back ( N );
+            ++ N;
+          }
+          std::vector<std::pair<int64_t, double> > results;
+          parallel ( &results, arguments, functor );
+          for ( int i = 0; i < results . size (); ++ i ) {
+            if ( results [ i ] . first == -1 ) {
+              candidates . push_back ( arguments [ i ] );
+            } else {
+              record ( arguments [ i ], results [ i ] . first, results [ i ] . second );
+            }
+          }
+        }
+      }
+      // Workers are idle in Stages 2-5 while there are few candidates
+      speculate ( N );
+      // Stage 2. Build candidate Metric Tree.
+      //std::cout << "Stage 2. N = " << N << "\n";
+      telemetry_ -> stage ( 2, cohort, offset + N );
+      MetricTree<T,D> candidate_mt;
+      candidate_mt . assign ( distance_ );
+      boost::unordered_map<int64_t, int64_t> iterator_to_candidate_number;
+      /* Stage 2 */ {
+        InsertFunctor<T,D> functor ( &candidate_mt, samples_ );
+        std::vector<int64_t> results;
         std::vector<int64_t> arguments;
-        while ( N < samples_ . size () && arguments . size () < cohort_size_ ) {
-          arguments . push_back ( N );
-          ++ N;
+        for ( int i = 0; i < candidates . size (); ++ i ) {
+          arguments . push_back ( candidates [ i ] );
+          //std::cout << candidates[i] << " ";
         }
-        std::vector<bool> results;
         parallel ( &results, arguments, functor );
+        for ( int i = 0; i < candidates . size (); ++ i ) {
+          iterator_to_candidate_number [ results [ i ] ] = i;
+        }
+      }
+      
+      // DEBUG 
+      //std::cout << "candidate_mt . size () == " << candidate_mt . size () << "\n";
+      // END DEBUG
+
+      // Stage 3. Build adjacency lists for delta-closeness in 
+      //          candidate metric tree.
+      //std::cout << "Stage 3. N = " << N << "\n";
+      telemetry_ -> stage ( 3, cohort, offset + N );
+      std::vector< std::vector<std::pair<int64_t, double> > > 
+        adjacency_structure ( candidates . size () );
+      /* Stage 3 */ {
+        DeltaCloseFunctor<T,D> functor ( &candidate_mt, samples_, delta_ );
+        std::vector<int64_t> arguments;
+        for ( int i = 0; i < candidates . size (); ++ i ) {
+          arguments . push_back ( candidates [ i ] );
+        }
+        std::vector< std::vector<std::pair<iterator, double> > > results;
+        parallel ( &results, arguments, functor );
+        //std::cout << "Building adjacency structure.\n";
         for ( int i = 0; i < results . size (); ++ i ) {
-          if ( results [ i ] ) {
-            candidates . push_back ( arguments [ i ] );
+          //std::cout << "adjacency_structure[" << i << "] = ";
+          for ( int j = 0; j < results [ i ] . size (); ++ j ) {
+            adjacency_structure [ i ] . 
+              push_back ( std::make_pair ( iterator_to_candidate_number 
+                [ candidate_mt . index ( results [ i ] [ j ] . first ) ],
+                results [ i ] [ j ] . second ) );
+            //std::cout << adjacency_structure [ i ] . back () << " ";
           }
+          //std::cout << "\n";
         }
       }
-    }
-    // Stage 2. Build candidate Metric Tree.
-    //std::cout << "Stage 2. N = " << N << "\n";
-    MetricTree<T,D> candidate_mt;
-    candidate_mt . assign ( distance_ );
-    boost::unordered_map<int64_t, int64_t> iterator_to_candidate_number;
-    /* Stage 2 */ {
-      InsertFunctor<T,D> functor ( &candidate_mt, samples_ );
-      std::vector<int64_t> results;
-      std::vector<int64_t> arguments;
+
+      // Stage 4. Compute a maximal independent set of the graph on 
+      //          candidates described by adjacency_structure. We use 
+      //          a serial greedy algorithm.
+      //std::cout << "Stage 4. N = " << N << "\n";
+      telemetry_ -> stage ( 4, cohort, offset + N );
+      std::vector<bool> accepted ( candidates . size (), true );
       for ( int i = 0; i < candidates . size (); ++ i ) {
-        arguments . push_back ( candidates [ i ] );
-        //std::cout << candidates[i] << " ";
+        if ( accepted [ i ] ) {
+          std::vector<std::pair<int64_t, double> > & adjacency_list = 
+            adjacency_structure [ i ];
+          for ( std::pair<int64_t, double> const& edge : adjacency_list ) {
+            int64_t j = edge . first;
+            if ( i == j ) continue;
+            accepted [ j ] = false;
+            // i is final, so it witnesses j
+            record ( candidates [ j ], samples_ [ candidates [ i ] ] . id, edge . second );
+          }
+        }
       }
-      parallel ( &results, arguments, functor );
-      for ( int i = 0; i < candidates . size (); ++ i ) {
-        iterator_to_candidate_number [ results [ i ] ] = i;
+
+      // Stage 5. Insert accepted candidates.
+      //std::cout << "Stage 5. N = " << N << "\n";
+      telemetry_ -> stage ( 5, cohort, offset + N );
+      /* Stage 5 */ { 
+        InsertFunctor<T,D> functor ( mt_, samples_ );
+        std::vector<int64_t> results;
+        std::vector<int64_t> arguments;
+        for ( int i = 0; i < candidates . size (); ++ i ) {
+          if ( accepted [ i ] ) {
+            arguments . push_back ( candidates [ i ] );
+            record ( candidates [ i ], samples_ [ candidates [ i ] ] . id, 0.0 );
+          }
+        }
+        parallel ( &results, arguments, functor );
+        depths ();
+      }
+
+      // Cohort boundary. No operations are in flight. Past the time
+      // limit the run stops here, to be resumed from the checkpoint.
+      double elapsed = std::chrono::duration<double> 
+        ( std::chrono::steady_clock::now () - started ) . count ();
+      bool stop = N < end && elapsed >= time_limit_;
+      checkpoint_ -> write ( *mt_, *distance_, samples_, N, *levels_,
+                             N == end || stop );
+      distance_ -> flush ();
+      ++ cohort;
+      if ( stop ) {
+        mutex_ -> lock ();
+        * stopped_ = true;
+        * all_done_ = true;
+        mutex_ -> unlock ();
+        return;
       }
+      if ( merging && N == num_merge_ && end == num_merge_ ) end = resolve ( result );
     }
-    
-    // DEBUG 
-    //std::cout << "candidate_mt . size () == " << candidate_mt . size () << "\n";
-    // END DEBUG
-
-    // Stage 3. Build adjacency lists for delta-closeness in 
-    //          candidate metric tree.
-    //std::cout << "Stage 3. N = " << N << "\n";
-    std::vector< std::vector<int64_t> > adjacency_structure ( candidates . size () );
-    /* Stage 3 */ {
-      DeltaCloseFunctor<T,D> functor ( &candidate_mt, samples_, delta_ );
-      std::vector<int64_t> arguments;
-      for ( int i = 0; i < candidates . size (); ++ i ) {
-        arguments . push_back ( candidates [ i ] );
+    // Compute nearest neighbors (only within the partition, if partitioned;
+    // the other entries are -1)
+    int64_t nearest_end = ( num_partitions_ > 1 ) ? end : NumSamples;
+    if ( exact_nearest_ && nearest . size () != NumSamples ) {
+      telemetry_ -> stage ( 6, cohort, offset + N );
+      // Samples of a previous run already have a nearest subsample point,
+      // within delta. It can only change if a point added in this run is
+      // closer than delta, which is checked on a tree of the added points.
+      std::vector<int64_t> previous_arguments;
+      int64_t num_seeds = seeds_ . size ();
+      if ( num_previous_ > 0 && mt_ -> size () > num_seeds ) {
+        std::vector<T> added ( mt_ -> node ( num_seeds ), mt_ -> end () );
+        MetricTree<T,D> added_mt;
+        added_mt . assign ( distance_ );
+        /* Build tree of added points */ {
+          InsertFunctor<T,D> functor ( &added_mt, added );
+          std::vector<int64_t> added_arguments ( added . size () );
+          std::iota (std::begin(added_arguments), std::end(added_arguments), 0);
+          std::vector<int64_t> results;
+          parallel ( &results, added_arguments, functor );
+        }
+        /* Find previous samples close to an added point */ {
+          std::vector<int64_t> close_arguments;
+          for ( int64_t i = 0; i < num_previous_; ++ i ) {
+            if ( nearest[samples_[i].id] != samples_[i].id ) {
+              close_arguments . push_back ( i );
+            }
+          }
+          NearestNeighborFunctor<T,D> functor ( &added_mt, samples_, delta_ );
+          std::vector<iterator> results;
+          parallel ( &results, close_arguments, functor );
+          for ( int64_t i = 0; i < close_arguments . size (); ++ i ) {
+            if ( results [ i ] != added_mt . end () ) {
+              previous_arguments . push_back ( close_arguments [ i ] );
+            }
+          }
+        }
       }
-      std::vector< std::vector<iterator> > results;
-      parallel ( &results, arguments, functor );
-      //std::cout << "Building adjacency structure.\n";
-      for ( int i = 0; i < results . size (); ++ i ) {
-        //std::cout << "adjacency_structure[" << i << "] = ";
-        for ( int j = 0; j < results [ i ] . size (); ++ j ) {
-          adjacency_structure [ i ] . 
-            push_back ( iterator_to_candidate_number 
-              [ candidate_mt . index ( results [ i ] [ j ] ) ] );
-          //std::cout << adjacency_structure [ i ] . back () << " ";
+      nearest . resize ( NumSamples, -1 );
+      /* Previous samples */ {
+        NearestNeighborFunctor<T,D> functor ( mt_, samples_, delta_ );
+        std::vector<iterator> results;
+        parallel ( &results, previous_arguments, functor );
+        for ( int64_t i = 0; i < previous_arguments . size (); ++ i ) {
+          nearest[samples_[previous_arguments[i]].id] = results[i] -> id;
         }
-        //std::cout << "\n";
       }
-    }
-
-    // Stage 4. Compute a maximal independent set of the graph on 
-    //          candidates described by adjacency_structure. We use 
-    //          a serial greedy algorithm.
-    //std::cout << "Stage 4. N = " << N << "\n";
-    std::vector<bool> accepted ( candidates . size (), true );
-    for ( int i = 0; i < candidates . size (); ++ i ) {
-      if ( accepted [ i ] ) {
-        std::vector<int64_t> & adjacency_list = 
-          adjacency_structure [ i ];
-        for ( int64_t j : adjacency_list ) {
-          if ( i == j ) continue;
-          accepted [ j ] = false;
+      /* New samples */ {
+        // The nearest subsample point is the witness unless a point is
+        // strictly closer, so the search is bounded by the witness 
+        // distance. A sample at distance zero from its witness is done.
+        std::vector<int64_t> arguments;
+        std::vector<double> bounds ( NumSamples );
+        for ( int64_t i = num_previous_; i < nearest_end; ++ i ) {
+          int64_t id = samples_ [ i ] . id;
+          nearest [ id ] = witness [ id ];
+          bounds [ i ] = witness_distance [ id ];
+          if ( bounds [ i ] > 0.0 ) arguments . push_back ( i );
+        }
+        NearestNeighborFunctor<T,D> functor ( mt_, samples_, bounds );
+        std::vector<iterator> results;
+        parallel ( &results, arguments, functor );
+        for ( int64_t i = 0; i < arguments . size (); ++ i ) {
+          if ( results [ i ] != mt_ -> end () ) {
+            nearest[samples_[arguments[i]].id] = results[i] -> id;
+          }
         }
       }
     }
-
-    // Stage 5. Insert accepted candidates.
-    //std::cout << "Stage 5. N = " << N << "\n";
-    /* Stage 5 */ { 
-      InsertFunctor<T,D> functor ( mt_, samples_ );
-      std::vector<int64_t> results;
+    if ( not exact_nearest_ ) {
+      // Only samples without a witness (if any) need a search
       std::vector<int64_t> arguments;
-      for ( int i = 0; i < candidates . size (); ++ i ) {
-        if ( accepted [ i ] ) {
-          arguments . push_back ( candidates [ i ] );
+      for ( int64_t i = 0; i < nearest_end; ++ i ) {
+        if ( witness [ samples_ [ i ] . id ] == -1 ) arguments . push_back ( i );
+      }
+      if ( not arguments . empty () ) {
+        telemetry_ -> stage ( 6, cohort, offset + N );
+        NearestNeighborFunctor<T,D> functor ( mt_, samples_ );
+        std::vector<iterator> results;
+        parallel ( &results, arguments, functor );
+        for ( int64_t i = 0; i < arguments . size (); ++ i ) {
+          witness[samples_[arguments[i]].id] = results[i] -> id;
         }
       }
-      parallel ( &results, arguments, functor );
     }
-  }
-  // Compute nearest neighbors
-  uint64_t NumSamples = samples_ . size ();
-  std::vector<int64_t> arguments(NumSamples);
-  std::iota (std::begin(arguments), std::end(arguments), 0);
-  NearestNeighborFunctor<T,D> functor ( mt_, samples_ );
-  std::vector<iterator> results;
-  parallel ( &results, arguments, functor );
-  (*nearest_) . resize ( NumSamples );
-  for ( int64_t i = 0; i < NumSamples; ++ i ) {
-    (*nearest_)[samples_[i].id] = results[i] -> id;
+    // Level boundary. The next level starts from the beginning.
+    result . size = mt_ -> size ();
+    N = 0;
+    num_previous_ = 0;
+    checkpoint_ -> write ( *mt_, *distance_, samples_, N, *levels_, true );
   }
   // Finish
+  telemetry_ -> stage ( 7, cohort, deltas_ . size () * NumSamples );
   mutex_ -> lock ();
   //std::cout << "All done! \n";
   * all_done_ = true;
   mutex_ -> unlock ();
 }
 
+template < class T, class D >
+void SubsampleThread<T,D>::
+depths ( void ) {
+  for ( ; num_depths_ < mt_ -> size (); ++ num_depths_ ) {
+    typename MetricTree<T,D>::iterator it = mt_ -> node ( num_depths_ );
+    typename MetricTree<T,D>::iterator parent = mt_ -> parent ( it );
+    distance_ -> depth ( it -> id, ( parent == mt_ -> end () ) ? 0 : 
+                                   distance_ -> depth ( parent -> id ) + 1 );
+  }
+}
+
+template < class T, class D >
+int64_t SubsampleThread<T,D>::
+partition ( void ) {
+  std::vector<int64_t> pivots ( num_partitions_ );
+  for ( int64_t i = 0; i < samples_ . size (); ++ i ) {
+    if ( samples_ [ i ] . id < num_partitions_ ) pivots [ samples_ [ i ] . id ] = i;
+  }
+  MetricTree<T,D> pivot_mt;
+  pivot_mt . assign ( distance_ );
+  /* Build tree of pivots */ {
+    InsertFunctor<T,D> functor ( &pivot_mt, samples_ );
+    std::vector<int64_t> results;
+    parallel ( &results, pivots, functor );
+  }
+  std::vector<char> inside ( samples_ . size (), 0 ); // by id
+  /* Find the nearest pivot of every sample */ {
+    PivotFunctor<T,D> functor ( &pivot_mt, samples_ );
+    std::vector<int64_t> arguments ( samples_ . size () );
+    std::iota (std::begin(arguments), std::end(arguments), 0);
+    std::vector<int64_t> results;
+    parallel ( &results, arguments, functor );
+    for ( int64_t i = 0; i < samples_ . size (); ++ i ) {
+      inside [ samples_ [ i ] . id ] = ( results [ i ] == partition_ );
+    }
+  }
+  // Stable, so the order restored from a checkpoint is kept
+  return std::stable_partition ( samples_ . begin (), samples_ . end (), 
+    [&] ( T const& p ) { return inside [ p . id ]; } ) - samples_ . begin ();
+}
+
+template < class T, class D >
+int64_t SubsampleThread<T,D>::
+resolve ( SubsampleLevel & result ) {
+  boost::unordered_set<int64_t> kept;
+  for ( typename MetricTree<T,D>::iterator it = mt_ -> begin (); 
+        it != mt_ -> end (); ++ it ) {
+    kept . insert ( it -> id );
+  }
+  typename std::vector<T>::iterator covered = 
+    std::stable_partition ( samples_ . begin () + num_merge_, samples_ . end (), 
+      [&] ( T const& p ) { return kept . count ( merge_witness_ [ p . id ] ) == 0; } );
+  for ( typename std::vector<T>::iterator it = covered; it != samples_ . end (); ++ it ) {
+    if ( result . witness [ it -> id ] == -1 ) {
+      result . witness [ it -> id ] = merge_witness_ [ it -> id ];
+      result . witness_distance [ it -> id ] = delta_;
+    }
+  }
+  return covered - samples_ . begin ();
+}
+
+template < class T, class D >
+void SubsampleThread<T,D>::
+speculate ( int64_t N ) {
+  if ( speculative_ == NULL ) return;
+  const int64_t levels = 3;
+  std::vector<int64_t> top;
+  if ( mt_ -> size () > 0 ) top . push_back ( mt_ -> index ( mt_ -> root () ) );
+  for ( int64_t level = 1, begin = 0; level < levels; ++ level ) {
+    int64_t end = top . size ();
+    for ( int64_t i = begin; i < end; ++ i ) {
+      typename MetricTree<T,D>::iterator L = mt_ -> left ( mt_ -> node ( top [ i ] ) );
+      typename MetricTree<T,D>::iterator R = mt_ -> right ( mt_ -> node ( top [ i ] ) );
+      if ( L != mt_ -> end () ) top . push_back ( mt_ -> index ( L ) );
+      if ( R != mt_ -> end () ) top . push_back ( mt_ -> index ( R ) );
+    }
+    begin = end;
+  }
+  std::deque<std::pair<T,T> > predicted;
+  // Breadth first, so the most likely distances are computed first
+  for ( int64_t node : top ) {
+    for ( int64_t i = N; i < samples_ . size () && i < N + cohort_size_; ++ i ) {
+      predicted . push_back ( std::make_pair ( samples_ [ i ], * mt_ -> node ( node ) ) );
+    }
+  }
+  mutex_ -> lock ();
+  speculative_ -> swap ( predicted );
+  mutex_ -> unlock ();
+}
+
 template < class T, class D >
 template < class FunctionObject > void SubsampleThread<T,D>::
 parallel ( std::vector<typename FunctionObject::ReturnType> * results,
            std::vector<int64_t> const& arguments,
            FunctionObject & F ) {
-  typedef typename FunctionObject::ReturnType ReturnType;
   typedef typename FunctionObject::Exception Exception;
-  time_delay_ = 1;
   results -> resize ( arguments . size () );
-
-  boost::unordered_map <int64_t, Exception> exceptions;
+  ++ stage_sequence_;
   int64_t num_to_compute = arguments . size ();    
+  std::vector<int64_t> depth ( num_to_compute, 0 );
+  // Operation n is suspended in exceptions [ n ] while suspended [ n ].
+  // Only the thread which popped n from ready_ touches these entries.
+  std::vector<Exception> exceptions ( num_to_compute );
+  std::vector<char> suspended ( num_to_compute, 0 );
   int64_t computed = 0;
   if ( not ready_ -> empty () ) {
     throw std::logic_error ( "Did not finish previous stage.\n");
@@ -303,77 +763,113 @@ parallel ( std::vector<typename FunctionObject::ReturnType> * results,
     ready_ -> push ( n );
   }
   mutex_ -> unlock ();
-  
-  while ( computed < num_to_compute ) {
-    // DEBUG BEGIN
-    /*
-    for ( int i = 0; i < num_to_compute; ++ i ) {
-      if ( exceptions . count ( i ) != 0 ) {
-        try {
-          typename MetricTree<T,D>::InsertException& ie =  
-          dynamic_cast<typename MetricTree<T,D>::InsertException&>(exceptions [i ]);
-          std::cout << "insertion exception " << i << " inspected: e.index = " << ie.index << "\n";
-        } catch ( std::bad_cast& bc ) { std::cout << "not an insert exception inspected (0)\n";}
-      }
-    }
-    */
-    // DEBUG END
 
-    mutex_ -> lock ();
-    if ( ready_ -> empty () ) {
-      mutex_ -> unlock ();
-      //std::cout << "Waiting " << time_delay_ << " microseconds.\n";
-      boost::this_thread::sleep( boost::posix_time::microseconds(time_delay_) );
-      if ( time_delay_ < 1000000 ) time_delay_ = time_delay_ * 2;
-      continue;
-    }
-    time_delay_ = 1;
-    //std::cout << "Processing something.\n";
-    int64_t n = ready_ -> top ();
-    //std::cout << "Processing " << n << "\n";
-
-    ready_ -> pop ();
-    mutex_ -> unlock ();
-    try {
-      if ( exceptions . count ( n ) == 0 ) {
-        //std::cout << "Initializing operation " << n << "\n";
-        (*results)[n] = F ( arguments [ n ] );
-      } else {
-        //std::cout << "Resuming operation " << n << "\n";
-        /*
-        try {
-          typename MetricTree<T,D>::InsertException& ie =  
-          dynamic_cast<typename MetricTree<T,D>::InsertException&>(exceptions [ n ]);
-          std::cout << "insertion exception " << n << " resumed: e.index = " << ie.index << "\n";
-        } catch ( std::bad_cast& bc ) { std::cout << "not an insert exception resumed (1).\n";}
-        */
-        (*results)[n] = F ( exceptions [ n ] );
-        exceptions . erase ( n );
-      }
-      ++ computed;
-    } catch ( typename MetricTree<T,D>::Exception & e ) {
-      //std::cout << "parallel. Caught the exception!\n";
+  // Run operations until all have been computed
+  auto drive = [&] ( void ) {
+    int64_t time_delay = 1;
+    while ( 1 ) {
       mutex_ -> lock ();
-      while ( not e . calculations -> empty () ) {
-        std::pair < int64_t, std::pair < T, T > > item;
-        item . first = n;
-        item . second = e . calculations -> top ();
-        //std::cout << "pushing work_item ( " << n << ", " << item.second.first <<
-        //  ", " << item.second.second << ")\n";
-        e . calculations -> pop ();
-        work_items_ -> push ( item );
+      if ( computed == num_to_compute ) {
+        mutex_ -> unlock ();
+        return;
+      }
+      if ( ready_ -> empty () ) {
+        mutex_ -> unlock ();
+        //std::cout << "Waiting " << time_delay << " microseconds.\n";
+        boost::this_thread::sleep( boost::posix_time::microseconds(time_delay) );
+        if ( time_delay < 1000000 ) time_delay = time_delay * 2;
+        continue;
       }
+      time_delay = 1;
+      //std::cout << "Processing something.\n";
+      int64_t n = ready_ -> top ();
+      //std::cout << "Processing " << n << "\n";
+
+      ready_ -> pop ();
       mutex_ -> unlock ();
-      exceptions [ n ] = dynamic_cast<Exception&>(e);
-      /*
       try {
-          typename MetricTree<T,D>::InsertException& ie =  
-          dynamic_cast<typename MetricTree<T,D>::InsertException&>(exceptions [ n ]);
-          std::cout << "insertion exception " << n << " created: e.index = " << ie.index << "\n";
-        } catch ( std::bad_cast& bc ) { std::cout << "not an insert exception created (1)\n";}
-      */
+        if ( not suspended [ n ] ) {
+          //std::cout << "Initializing operation " << n << "\n";
+          (*results)[n] = F ( arguments [ n ] );
+        } else {
+          //std::cout << "Resuming operation " << n << "\n";
+          suspended [ n ] = 0;
+          (*results)[n] = F ( exceptions [ n ] );
+        }
+        mutex_ -> lock ();
+        ++ computed;
+        mutex_ -> unlock ();
+      } catch ( typename MetricTree<T,D>::Exception & e ) {
+        //std::cout << "parallel. Caught the exception!\n";
+        // Save the operation before its distances can be computed
+        // and n handed to another thread. The copy shares the stacks
+        // of "e", so it gets its own (a resumed operation pushes onto
+        // them), and the requested distances are taken from "e" here.
+        exceptions [ n ] = dynamic_cast<Exception&>(e);
+        exceptions [ n ] . calculations . reset ( new std::stack<std::pair<T,T> > );
+        exceptions [ n ] . bounds . reset ( new std::stack<double> );
+        suspended [ n ] = 1;
+        std::vector<std::pair<T,T> > pairs;
+        std::vector<double> bounds;
+        while ( not e . calculations -> empty () ) {
+          pairs . push_back ( e . calculations -> top () );
+          bounds . push_back ( e . bounds -> top () );
+          e . calculations -> pop ();
+          e . bounds -> pop ();
+        }
+        // The operation waits for its distances, unless another 
+        // operation already has. Cheap distances are computed here, 
+        // saving a round trip; others are requested unless another 
+        // operation already has. Operations waiting for a distance
+        // resume when it is cached (this one, too, if computed here).
+        std::vector<std::pair<T,T> > remote;
+        std::vector<int64_t> woken;
+        bool waiting = false;
+        std::vector<double> remote_bounds;
+        for ( int64_t k = 0; k < pairs . size (); ++ k ) {
+          std::pair<T,T> const& pair = pairs [ k ];
+          double bound = bounds [ k ];
+          int status = distance_ -> wait ( pair . first, pair . second, n, bound );
+          if ( status != 2 ) waiting = true;
+          if ( status != 2 && 
+               distance_ -> cost ( pair . first, pair . second ) < local_cost_ ) {
+            std::vector<int64_t> released = distance_ -> cache ( pair . first, pair . second, 
+              distance_ -> compute ( pair . first, pair . second, bound ), bound );
+            woken . insert ( woken . end (), released . begin (), released . end () );
+            telemetry_ -> localDistanceCompleted ();
+          } else if ( status == 1 ) {
+            remote . push_back ( pair );
+            remote_bounds . push_back ( bound );
+          }
+        }
+        mutex_ -> lock ();
+        for ( int64_t m : woken ) ready_ -> push ( m );
+        for ( int64_t k = 0; k < remote . size (); ++ k ) {
+          SubsampleWorkItem<T> item;
+          item . n = n;
+          item . points = remote [ k ];
+          item . bound = remote_bounds [ k ];
+          item . stage = stage_sequence_;
+          item . depth = depth [ n ];
+          item . sequence = request_sequence_ ++;
+          //std::cout << "pushing work_item ( " << n << ", " << item.points.first <<
+          //  ", " << item.points.second << ")\n";
+          work_items_ -> push ( item );
+        }
+        if ( not waiting ) ready_ -> push ( n );
+        ++ depth [ n ];
+        mutex_ -> unlock ();
+      }
     }
-  }
+  };
+
+  // Searches only read the tree, so they may run on several threads. 
+  // Insertions modify it, so they run on this one.
+  int64_t num_threads = FunctionObject::concurrent ? num_threads_ : 1;
+  boost::thread_group threads;
+  for ( int64_t k = 1; k < num_threads; ++ k ) threads . create_thread ( drive );
+  drive ();
+  threads . join_all ();
 }
 
 template < class T, class D >
@@ -385,44 +881,200 @@ command_line ( int argc, char * argv [] ) {
   time_delay_ = 1;
   distance_ . reset ( new D ( config_ . getDistanceFunctor () ) );
   cohort_size_ = config_ . getCohortSize ();
+  speculation_budget_ = config_ . getSpeculationBudget ();
+  batch_size_ . assign ( config_ . getBatchSize (), config_ . getMaxBatchSize () );
+  distance_ -> limit ( config_ . getCacheMemory () );
+  straggler_factor_ = config_ . getStragglerFactor ();
+  completed_seconds_ = 0.0;
+  completed_ = 0;
+  // Every process loads the samples, so jobs need only carry ids
+  std::vector<T> const& samples = config_ . getSamples ();
+  store_ . resize ( samples . size () );
+  for ( int64_t i = 0; i < samples . size (); ++ i ) {
+    store_ [ samples [ i ] . id ] = i;
+  }
 }
 
 template < class T, class D >
 void SubsampleProcess<T,D>::
 initialize ( void ) {
   all_done_ = false;
+  stopped_ = false;
   samples_ = config_ . getSamples ();
-  delta_   = config_ . getDelta ();
+  deltas_  = config_ . getDeltas ();
   mt_ . assign ( distance_ );
+  start_ = 0;
+  levels_ . assign ( deltas_ . size (), SubsampleLevel () );
+  // Incremental update: the samples of the previous run go first
+  num_previous_ = config_ . getPreviousNearest () . size ();
+  if ( num_previous_ > 0 ) {
+    std::stable_partition ( samples_ . begin (), samples_ . end (), 
+      [&] ( T const& p ) { return p . id < num_previous_; } );
+    std::vector<int64_t> position ( samples_ . size () );
+    for ( int64_t i = 0; i < samples_ . size (); ++ i ) {
+      position [ samples_ [ i ] . id ] = i;
+    }
+    for ( int64_t id : config_ . getPreviousSubsample () ) {
+      seeds_ . push_back ( position [ id ] );
+    }
+    start_ = num_previous_;
+    // The previous nearest points are within delta of the old samples
+    std::vector<int64_t> const& previous = config_ . getPreviousNearest ();
+    SubsampleLevel & level = levels_ [ 0 ];
+    if ( config_ . getExactNearest () ) level . nearest = previous;
+    level . witness . assign ( samples_ . size (), -1 );
+    level . witness_distance . assign ( samples_ . size (), 
+                                        std::numeric_limits<double>::infinity() );
+    for ( int64_t id = 0; id < num_previous_; ++ id ) {
+      level . witness [ id ] = previous [ id ];
+      level . witness_distance [ id ] = deltas_ [ 0 ];
+    }
+  }
+  // Merge of partitions: the union of their subsamples goes first
+  num_merge_ = config_ . getMergeSubsample () . size ();
+  if ( num_merge_ > 0 ) {
+    boost::unordered_set<int64_t> merged ( config_ . getMergeSubsample () . begin (),
+                                           config_ . getMergeSubsample () . end () );
+    std::stable_partition ( samples_ . begin (), samples_ . end (), 
+      [&] ( T const& p ) { return merged . count ( p . id ) > 0; } );
+  }
+  // A checkpoint belongs to the outputs of other runs this run starts from
+  uint64_t inputs = 0;
+  for ( std::vector<int64_t> const* v : { &config_ . getPreviousSubsample (),
+                                          &config_ . getPreviousNearest (),
+                                          &config_ . getMergeSubsample (),
+                                          &config_ . getMergeWitness () } ) {
+    boost::hash_combine ( inputs, v -> size () );
+    boost::hash_range ( inputs, v -> begin (), v -> end () );
+  }
+  checkpoint_ . assign ( config_ . getCheckpointFile (), 
+                         config_ . getCheckpointInterval (),
+                         deltas_, config_ . getMetric (), 
+                         config_ . getRelativeError (),
+                         config_ . getPartition (),
+                         config_ . getNumPartitions (), inputs );
+  telemetry_ . assign ( config_ . getTelemetryFile (), 
+                        config_ . getTelemetryInterval (),
+                        deltas_ . size () * samples_ . size () );
+  if ( not config_ . getDistanceStore () . empty () ) {
+    std::vector<T> const& points = config_ . getSamples ();
+    std::vector<uint64_t> hashes ( points . size () );
+    for ( T const& p : points ) hashes [ p . id ] = p . hash ();
+    distance_ -> store ( boost::shared_ptr<DistanceStore> 
+      ( new DistanceStore ( config_ . getDistanceStore (), config_ . getMetric () ) ),
+      hashes );
+  }
+  calibrate ();
+  if ( config_ . getResume () ) {
+    checkpoint_ . read ( &mt_, distance_ . get (), &samples_, &start_, 
+                         &levels_ );
+  }
   thread_ptr . reset ( new boost::thread 
-    ( SubsampleThread<T,D> ( &mt_, &nearest_, samples_, delta_, &ready_, &mutex_, 
-                             &all_done_, &work_items_, distance_, cohort_size_ ) ) );
+    ( SubsampleThread<T,D> ( &mt_, &levels_, samples_, deltas_, &ready_, &mutex_, 
+                             &all_done_, &work_items_, distance_, cohort_size_,
+                             &checkpoint_, start_, &telemetry_, 
+                             seeds_, num_previous_, 
+                             config_ . getExactNearest (),
+                             speculation_budget_ > 0 ? &speculative_ : NULL,
+                             config_ . getCoordinatorThreads (),
+                             local_cost_, config_ . getPartition (),
+                             config_ . getNumPartitions (),
+                             config_ . getMergeWitness (), num_merge_,
+                             config_ . getTimeLimit (), &stopped_ ) ) );
 }
 
 template < class T, class D >
 int SubsampleProcess<T,D>::
 prepare ( Message & job ) {
+  report ();
   mutex_ . lock ();
   if ( all_done_ ) { 
     //std::cout << "prepare. All done!\n";
     mutex_ . unlock ();
     return 1;
   }
-  if ( work_items_ . empty () ) {
+  // A job is a batch of up to batch_size_ distances, (sequence, p.id, q.id),
+  // where the sequence is -1 for a speculative distance, and their bounds
+  std::vector<int64_t> batch;
+  std::vector<double> bounds;
+  std::vector<int64_t> sequences;
+  while ( not work_items_ . empty () && batch . size () < 3 * batch_size_ . size () ) {
+    SubsampleWorkItem<T> const& item = work_items_ . top ();
+    // A speculative result may have arrived since it was requested
+    if ( distance_ -> cached ( item . points . first . id, item . points . second . id, 
+                               item . bound ) ) {
+      work_items_ . pop ();
+      continue;
+    }
+    batch . push_back ( item . sequence );
+    batch . push_back ( item . points . first . id );
+    batch . push_back ( item . points . second . id );
+    bounds . push_back ( item . bound );
+    //std::cout << "popping work_item ( " << item . n << ", " << item.points.first <<
+    //        ", " << item.points.second << ")\n";
+    outstanding_ [ item . sequence ] . item = item;
+    sequences . push_back ( item . sequence );
+    work_items_ . pop ();
+  }
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+  double mean = ( completed_ > 0 ) ? completed_seconds_ / (double) completed_ : 0.0;
+  for ( int64_t sequence : sequences ) {
+    SubsampleOutstanding<T> & outstanding = outstanding_ [ sequence ];
+    outstanding . issued = now;
+    outstanding . expected = mean * (double) sequences . size ();
+    outstanding . duplicated = false;
+  }
+  // Near the end of a stage, when workers run out of work, the oldest
+  // distance which is taking far longer than expected is sent again.
+  // Round trips vary with the load of the coordinator and the network,
+  // so none is taken for a straggler before it is a second old.
+  const double min_age = 1.0;
+  if ( batch . empty () && straggler_factor_ > 0.0 && completed_ > 0 ) {
+    typename std::map<int64_t, SubsampleOutstanding<T> >::iterator oldest = outstanding_ . end ();
+    for ( typename std::map<int64_t, SubsampleOutstanding<T> >::iterator it = outstanding_ . begin ();
+          it != outstanding_ . end (); ++ it ) {
+      SubsampleOutstanding<T> const& outstanding = it -> second;
+      double age = std::chrono::duration<double> ( now - outstanding . issued ) . count ();
+      if ( outstanding . duplicated || age < min_age ||
+           age < straggler_factor_ * std::max ( outstanding . expected, mean ) ) continue;
+      if ( oldest == outstanding_ . end () || 
+           outstanding . issued < oldest -> second . issued ) oldest = it;
+    }
+    if ( oldest != outstanding_ . end () ) {
+      oldest -> second . duplicated = true;
+      mutex_ . unlock ();
+      telemetry_ . duplicateIssued ();
+      job << (int64_t) 1;
+      job << std::vector<int64_t> { oldest -> first, 
+                                    oldest -> second . item . points . first . id,
+                                    oldest -> second . item . points . second . id };
+      job << std::vector<double> { oldest -> second . item . bound };
+      job << (int64_t) 1;
+      return 0;
+    }
+  }
+  // Idle workers compute distances predicted to be needed soon
+  bool idle = batch . empty ();
+  while ( idle && batch . size () < 3 * batch_size_ . size () && speculation_budget_ > 0 && 
+          not speculative_ . empty () ) {
+    std::pair<T,T> pair = speculative_ . front ();
+    speculative_ . pop_front ();
+    if ( distance_ -> cached ( pair . first . id, pair . second . id ) ) continue;
+    -- speculation_budget_;
+    batch . push_back ( -1 );
+    batch . push_back ( pair . first . id );
+    batch . push_back ( pair . second . id );
+    bounds . push_back ( std::numeric_limits<double>::infinity () );
+  }
+  mutex_ . unlock ();
+  if ( batch . empty () ) {
     job << (int64_t) 0;
-    mutex_ . unlock ();
     return 0;
   }
-  std::pair < int64_t, std::pair < T, T > > & item =
-    work_items_ . top ();
   job << (int64_t) 1;
-  job << item . first;
-  job << item . second . first;
-  job << item . second . second;
-  //std::cout << "popping work_item ( " << item . first << ", " << item.second.first <<
-  //        ", " << item.second.second << ")\n";
-  work_items_ . pop ();
-  mutex_ . unlock ();
+  job << batch;
+  job << bounds;
+  job << (int64_t) 0;
   return 0;
 }
 
@@ -434,24 +1086,36 @@ work ( Message & result,
   job >> t;
   if ( t == 0 ) {
     // Timer Job.
+    result << (int64_t) 0;
+    result << (double) time_delay_ / 1000000.0;
     boost::this_thread::sleep( boost::posix_time::microseconds(time_delay_) );
     if ( time_delay_ < 1000000 ) time_delay_ = time_delay_ * 2;
-    result << (int64_t) 0;
   } else {
     time_delay_ = 1;
     // Distance Job.
-    int64_t n;
-    T p;
-    T q;
-    job >> n;
-    job >> p;
-    job >> q;
+    std::vector<int64_t> batch;
+    std::vector<double> bounds;
+    int64_t duplicate;
+    job >> batch;
+    job >> bounds;
+    job >> duplicate;
+    std::vector<double> distances;
+    std::vector<double> seconds;
+    for ( int64_t k = 0; k < batch . size (); k += 3 ) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+      distances . push_back ( distance_ -> compute ( point ( batch [ k + 1 ] ), 
+                                                     point ( batch [ k + 2 ] ),
+                                                     bounds [ k / 3 ] ) );
+      seconds . push_back ( std::chrono::duration<double> 
+        ( std::chrono::steady_clock::now () - start ) . count () );
+      //std::cout << "Computed distance between " << p << " and " << q << "\n";
+    }
     result << (int64_t) 1;
-    result << n;
-    result << p;
-    result << q;
-    result << distance_ -> compute (p, q);
-    //std::cout << "Computed distance between " << p << " and " << q << "\n";
+    result << batch;
+    result << bounds;
+    result << duplicate;
+    result << distances;
+    result << seconds;
   }
 }
 
@@ -460,32 +1124,138 @@ void SubsampleProcess<T,D>::
 accept ( const Message &result ) {
   int64_t t;
   result >> t;
-  if ( t == 0 ) return;
-  int64_t n;
-  T p;
-  T q;
-  double dist;
-  result >> n;
-  result >> p;
-  result >> q;
-  result >> dist;
-  //std::cout << "Received distance between " << p << " and " << q << "\n";
-
-  distance_ -> cache ( p, q, dist );
+  if ( t == 0 ) {
+    double seconds;
+    result >> seconds;
+    telemetry_ . timerCompleted ( seconds );
+    return;
+  }
+  std::vector<int64_t> batch;
+  std::vector<double> bounds;
+  int64_t duplicate;
+  std::vector<double> distances;
+  std::vector<double> seconds;
+  result >> batch;
+  result >> bounds;
+  result >> duplicate;
+  result >> distances;
+  result >> seconds;
+  // Measure the round trip of the job from its first requested distance
+  if ( not duplicate && not batch . empty () && batch [ 0 ] >= 0 ) {
+    mutex_ . lock ();
+    typename std::map<int64_t, SubsampleOutstanding<T> >::iterator it = 
+      outstanding_ . find ( batch [ 0 ] );
+    if ( it != outstanding_ . end () ) {
+      double round_trip = std::chrono::duration<double> 
+        ( std::chrono::steady_clock::now () - it -> second . issued ) . count ();
+      batch_size_ . record ( distances . size (), 
+        std::accumulate ( seconds . begin (), seconds . end (), 0.0 ), round_trip );
+      completed_seconds_ += round_trip;
+      completed_ += distances . size ();
+    }
+    mutex_ . unlock ();
+  }
+  for ( int64_t k = 0; k < distances . size (); ++ k ) {
+    int64_t sequence = batch [ 3 * k ];
+    int64_t p = batch [ 3 * k + 1 ];
+    int64_t q = batch [ 3 * k + 2 ];
+    telemetry_ . distanceCompleted ( seconds [ k ] );
+    //std::cout << "Received distance between " << p << " and " << q << "\n";
+    if ( sequence < 0 ) {
+      // Speculative; operations may have begun waiting for it since
+      std::vector<int64_t> waiting = distance_ -> speculate ( p, q, distances [ k ] );
+      mutex_ . lock ();
+      for ( int64_t n : waiting ) ready_ . push ( n );
+      mutex_ . unlock ();
+      continue;
+    }
+    mutex_ . lock ();
+    typename std::map<int64_t, SubsampleOutstanding<T> >::iterator it = 
+      outstanding_ . find ( sequence );
+    if ( it == outstanding_ . end () ) {
+      // The other copy of a duplicated job was received first
+      mutex_ . unlock ();
+      continue;
+    }
+    outstanding_ . erase ( it );
+    mutex_ . unlock ();
+    if ( duplicate ) telemetry_ . duplicateWon ();
+    std::vector<int64_t> waiting = distance_ -> cache ( p, q, distances [ k ], bounds [ k ] );
+    mutex_ . lock ();
+    for ( int64_t n : waiting ) ready_ . push ( n );
+    mutex_ . unlock ();
+  }
+}
+
+template < class T, class D >
+void SubsampleProcess<T,D>::
+calibrate ( void ) {
+  // Time some of the cheapest distances between consecutive samples to
+  // estimate the time per unit of cost, and from it the cost of a 
+  // distance which takes getLocalDistanceTime () seconds.
+  local_cost_ = 0.0;
+  double local_time = config_ . getLocalDistanceTime ();
+  if ( local_time <= 0.0 ) return;
+  std::vector<std::pair<double, int64_t> > pairs;
+  for ( int64_t i = 0; i + 1 < samples_ . size () && pairs . size () < 200; i += 2 ) {
+    pairs . push_back ( std::make_pair ( 
+      distance_ -> cost ( samples_ [ i ], samples_ [ i + 1 ] ), i ) );
+  }
+  std::sort ( pairs . begin (), pairs . end () );
+  double total_cost = 0.0;
+  double total_time = 0.0;
+  for ( int64_t k = 0; k < pairs . size () && k < 20 && total_time < 0.1; ++ k ) {
+    int64_t i = pairs [ k ] . second;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+    double dist = distance_ -> compute ( samples_ [ i ], samples_ [ i + 1 ] );
+    total_time += std::chrono::duration<double> 
+      ( std::chrono::steady_clock::now () - start ) . count ();
+    total_cost += pairs [ k ] . first;
+    distance_ -> cache ( samples_ [ i ], samples_ [ i + 1 ], dist );
+  }
+  if ( total_cost > 0.0 && total_time > 0.0 ) {
+    local_cost_ = local_time * total_cost / total_time;
+  }
+}
+
+template < class T, class D >
+void SubsampleProcess<T,D>::
+report ( bool force ) {
+  if ( not telemetry_ . enabled () ) return;
   mutex_ . lock ();
-  ready_ . push ( n );
+  int64_t ready_depth = ready_ . size ();
+  int64_t work_items_depth = work_items_ . size ();
   mutex_ . unlock ();
+  int64_t hits, misses, speculated, used;
+  distance_ -> statistics ( &hits, &misses );
+  distance_ -> speculation ( &speculated, &used );
+  telemetry_ . report ( ready_depth, work_items_depth, hits, misses, 
+                        distance_ -> size (), distance_ -> evictions (),
+                        speculated, used, distance_ -> filtered (), force );
+}
+
+template < class T, class D >
+T const& SubsampleProcess<T,D>::
+point ( int64_t id ) const {
+  return config_ . getSamples () [ store_ [ id ] ];
 }
 
 template < class T, class D >
 void SubsampleProcess<T,D>::
 finalize ( void ) {
   //std::cout << "finalize.\n";
-  std::vector<T> results;
-  for ( T const& p : mt_ ) {
-    results . push_back ( p );
+  report ( true );
+  distance_ -> flush ();
+  if ( stopped_ ) {
+    std::cout << "Stopped at the time limit; resume with --resume.\n";
+    return;
+  }
+  // The subsample of each level is a prefix of the tree (in insertion order)
+  for ( int64_t level = 0; level < deltas_ . size (); ++ level ) {
+    std::vector<T> results ( mt_ . begin (), mt_ . node ( levels_ [ level ] . size ) );
+    config_ . handleResults ( results, levels_ [ level ] . nearest, 
+                              levels_ [ level ] . witness, level );
   }
-  config_ . handleResults ( results, nearest_ );
 }
 
 #endif
@@ -0,0 +1,287 @@
+/// SubsampleTelemetry.h
+///   This file provides the class "SubsampleTelemetry" which collects
+///   progress and throughput statistics on the coordinator of the
+///   "Subsample" program and periodically appends them as a JSON record
+///   (one per line) to a telemetry file, suitable for "tail -f" or for
+///   scraping by a monitoring tool.
+
+#ifndef SUBSAMPLETELEMETRY_H
+#define SUBSAMPLETELEMETRY_H
+
+#include <string>
+#include <fstream>
+#include <chrono>
+#include <stdexcept>
+
+#include "boost/thread/mutex.hpp"
+
+#include "tools/json.hpp"
+
+class SubsampleTelemetry {
+public:
+  /// SubsampleTelemetry
+  ///   Construct a disabled telemetry recorder
+  SubsampleTelemetry ( void );
+
+  /// assign
+  ///   Append a record to "filename" at most once every "interval"
+  ///   seconds. "total" is the number of samples in the run, 
+  ///   times the number of levels (deltas).
+  ///   An empty filename disables telemetry.
+  void
+  assign ( std::string const& filename,
+           double interval,
+           int64_t total );
+
+  /// enabled
+  ///   Return true if telemetry is enabled
+  bool
+  enabled ( void ) const;
+
+  /// level
+  ///   Record that the coordinator thread has begun the level
+  ///   (of a multi-delta run) with the given delta
+  void
+  level ( int64_t level, double delta );
+
+  /// stage
+  ///   Record that the coordinator thread has entered "stage"
+  ///   (1-5 for the cohort stages, 6 for the nearest neighbor pass)
+  ///   of cohort number "cohort", having read "processed" samples
+  ///   (counted over all levels). The samples processed before the
+  ///   first call (restored from a checkpoint) do not count towards
+  ///   the rate the eta is estimated from.
+  void
+  stage ( int stage, int64_t cohort, int64_t processed );
+
+  /// distanceCompleted
+  ///   Record a distance computed by a worker in "seconds"
+  void
+  distanceCompleted ( double seconds );
+
+  /// localDistanceCompleted
+  ///   Record a distance computed on the coordinator
+  void
+  localDistanceCompleted ( void );
+
+  /// duplicateIssued
+  ///   Record that a distance taking far longer than expected was
+  ///   sent again to an idle worker
+  void
+  duplicateIssued ( void );
+
+  /// duplicateWon
+  ///   Record that the second copy of a duplicated distance was
+  ///   received before the original
+  void
+  duplicateWon ( void );
+
+  /// timerCompleted
+  ///   Record a timer job (a worker with nothing to do) which
+  ///   kept a worker idle for "seconds"
+  void
+  timerCompleted ( double seconds );
+
+  /// report
+  ///   Append a record to the telemetry file if one is due (or if "force"
+  ///   is true). The arguments are the current queue depths, the
+  ///   cumulative cache lookup counts, the number of cached distances
+  ///   and of evictions, the cumulative counts of speculative 
+  ///   distances computed and later used, and the cumulative count of
+  ///   comparisons decided by cheap lower bounds.
+  void
+  report ( int64_t ready_depth,
+           int64_t work_items_depth,
+           int64_t cache_hits,
+           int64_t cache_misses,
+           int64_t cache_entries,
+           int64_t cache_evictions,
+           int64_t speculated,
+           int64_t speculation_used,
+           int64_t filtered,
+           bool force = false );
+
+private:
+  typedef std::chrono::steady_clock Clock;
+  std::string filename_;
+  std::ofstream outfile_;
+  double interval_;
+  int64_t total_;
+  Clock::time_point start_;
+  Clock::time_point last_report_;
+  int64_t level_;
+  double delta_;
+  int stage_;
+  int64_t cohort_;
+  int64_t processed_;
+  int64_t start_processed_; // at the first stage, or -1 before it
+  Clock::time_point start_stage_; // time of the first stage
+  int64_t distances_;
+  int64_t last_distances_;
+  int64_t local_distances_;
+  int64_t duplicated_;
+  int64_t duplicate_wins_;
+  double busy_seconds_;
+  double idle_seconds_;
+  double last_busy_seconds_;
+  double last_idle_seconds_;
+  boost::mutex mutex_;
+};
+
+inline SubsampleTelemetry::
+SubsampleTelemetry ( void ) : interval_ ( 0.0 ), total_ ( 0 ), level_ ( 0 ),
+  delta_ ( 0.0 ), stage_ ( 0 ),
+  cohort_ ( 0 ), processed_ ( 0 ), start_processed_ ( -1 ), 
+  distances_ ( 0 ), last_distances_ ( 0 ),
+  local_distances_ ( 0 ), duplicated_ ( 0 ), duplicate_wins_ ( 0 ),
+  busy_seconds_ ( 0.0 ), idle_seconds_ ( 0.0 ),
+  last_busy_seconds_ ( 0.0 ), last_idle_seconds_ ( 0.0 ) {}
+
+inline void SubsampleTelemetry::
+assign ( std::string const& filename,
+         double interval,
+         int64_t total ) {
+  filename_ = filename;
+  interval_ = interval;
+  total_ = total;
+  start_ = last_report_ = Clock::now ();
+  if ( not enabled () ) return;
+  outfile_ . open ( filename_, std::ios::app );
+  if ( not outfile_ ) {
+    throw std::runtime_error ( "SubsampleTelemetry::assign. Cannot open " + filename_ );
+  }
+}
+
+inline bool SubsampleTelemetry::
+enabled ( void ) const {
+  return not filename_ . empty ();
+}
+
+inline void SubsampleTelemetry::
+level ( int64_t level, double delta ) {
+  mutex_ . lock ();
+  level_ = level;
+  delta_ = delta;
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+stage ( int stage, int64_t cohort, int64_t processed ) {
+  mutex_ . lock ();
+  stage_ = stage;
+  cohort_ = cohort;
+  processed_ = processed;
+  if ( start_processed_ < 0 ) {
+    start_processed_ = processed;
+    start_stage_ = Clock::now ();
+  }
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+distanceCompleted ( double seconds ) {
+  mutex_ . lock ();
+  ++ distances_;
+  busy_seconds_ += seconds;
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+localDistanceCompleted ( void ) {
+  mutex_ . lock ();
+  ++ local_distances_;
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+duplicateIssued ( void ) {
+  mutex_ . lock ();
+  ++ duplicated_;
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+duplicateWon ( void ) {
+  mutex_ . lock ();
+  ++ duplicate_wins_;
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+timerCompleted ( double seconds ) {
+  mutex_ . lock ();
+  idle_seconds_ += seconds;
+  mutex_ . unlock ();
+}
+
+inline void SubsampleTelemetry::
+report ( int64_t ready_depth,
+         int64_t work_items_depth,
+         int64_t cache_hits,
+         int64_t cache_misses,
+         int64_t cache_entries,
+         int64_t cache_evictions,
+         int64_t speculated,
+         int64_t speculation_used,
+         int64_t filtered,
+         bool force ) {
+  if ( not enabled () ) return;
+  Clock::time_point now = Clock::now ();
+  double since_last = std::chrono::duration<double> ( now - last_report_ ) . count ();
+  if ( since_last < interval_ && not force ) return;
+  static const char * stage_names [] = { "startup", "aspiration",
+    "candidate tree", "delta close", "independent set", "insert",
+    "nearest", "done" };
+  using json = nlohmann::json;
+  json record;
+  mutex_ . lock ();
+  double elapsed = std::chrono::duration<double> ( now - start_ ) . count ();
+  double busy = busy_seconds_ - last_busy_seconds_;
+  double idle = idle_seconds_ - last_idle_seconds_;
+  record["elapsed"] = elapsed;
+  record["level"] = level_;
+  record["delta"] = delta_;
+  record["stage"] = stage_;
+  record["stage_name"] = stage_names [ stage_ ];
+  record["cohort"] = cohort_;
+  record["processed"] = processed_;
+  record["total"] = total_;
+  record["ready"] = ready_depth;
+  record["work_items"] = work_items_depth;
+  record["distances"] = distances_;
+  record["local_distances"] = local_distances_;
+  record["distances_per_second"] =
+    ( since_last > 0.0 ) ? ( distances_ - last_distances_ ) / since_last : 0.0;
+  record["cache_hit_rate"] = ( cache_hits + cache_misses > 0 ) ?
+    (double) cache_hits / (double) ( cache_hits + cache_misses ) : 0.0;
+  record["cache_hits"] = cache_hits;
+  record["cache_misses"] = cache_misses;
+  record["cache_entries"] = cache_entries;
+  record["cache_evictions"] = cache_evictions;
+  record["speculated"] = speculated;
+  record["speculation_hit_rate"] = ( speculated > 0 ) ?
+    (double) speculation_used / (double) speculated : 0.0;
+  record["filtered"] = filtered;
+  record["duplicated"] = duplicated_;
+  record["duplicate_wins"] = duplicate_wins_;
+  record["worker_idle_fraction"] =
+    ( busy + idle > 0.0 ) ? idle / ( busy + idle ) : 0.0;
+  // The nearest neighbor pass is not included in the estimate, which
+  // is from the rate since the first stage of this run
+  if ( start_processed_ >= 0 && processed_ > start_processed_ && stage_ < 6 ) {
+    double seconds = std::chrono::duration<double> ( now - start_stage_ ) . count ();
+    record["eta"] = seconds * (double) ( total_ - processed_ ) / 
+                    (double) ( processed_ - start_processed_ );
+  } else {
+    record["eta"] = nullptr;
+  }
+  last_distances_ = distances_;
+  last_busy_seconds_ = busy_seconds_;
+  last_idle_seconds_ = idle_seconds_;
+  mutex_ . unlock ();
+  last_report_ = now;
+  outfile_ << record . dump () << "\n";
+  outfile_ . flush ();
+}
+
+#endif
@@ -2,8 +2,22 @@
 /// Author: Shaun Harker
 /// Date: July 17, 2014
 #include <vector>
+#include <map>
+#include <chrono>
+#include "boost/thread/thread.hpp"
 #include "cluster-delegator.hpp" 
 #include "subsample/SubsampleConfig.h" // Defines class Point, class Distance
+#include "subsample/SubsampleBatch.h"
+
+/// OutstandingBatch
+///   A batch sent to a worker and not yet received. Near the end of
+///   the run, batches taking much longer than expected are sent again
+///   to idle workers, and the first result received is used.
+struct OutstandingBatch {
+  std::vector<int64_t> batch;
+  std::chrono::steady_clock::time_point issued;
+  bool duplicated;
+};
 
 class ComputeMatrixProcess : public Coordinator_Worker_Process {
 public:
@@ -20,6 +34,13 @@ private:
   int64_t N_;
   int64_t last_job_;
   int64_t result_index_;
+  SubsampleBatch batch_size_;
+  double straggler_factor_;
+  std::map<int64_t, OutstandingBatch> outstanding_; // by first result index
+  double completed_seconds_; // total round trip time of batches computed by workers
+  int64_t completed_; // number of batches computed by workers
+  boost::shared_ptr<DistanceStore> store_;
+  std::vector<uint64_t> hashes_; // by index in subsamples_
   DistanceMatrixConfig config_;
   std::vector<Point> subsamples_;
   std::vector<double> results_;
@@ -39,51 +60,148 @@ initialize ( void ) {
   subsamples_ = config_ . getSubsamples ();
   job_num_ = 0;
   result_index_ = 0;
+  batch_size_ . assign ( config_ . getBatchSize (), config_ . getMaxBatchSize () );
+  straggler_factor_ = config_ . getStragglerFactor ();
+  completed_seconds_ = 0.0;
+  completed_ = 0;
   N_ = subsamples_ . size ();
   last_job_ = N_ * N_;
   results_ . resize ( (N_ * N_ - N_) / 2 );
+  if ( not config_ . getDistanceStore () . empty () ) {
+    store_ . reset ( new DistanceStore ( config_ . getDistanceStore (), 
+                                         config_ . getMetric () ) );
+    for ( Point const& p : subsamples_ ) hashes_ . push_back ( p . hash () );
+  }
 }
 
 int  ComputeMatrixProcess::
 prepare ( Message & job ) {
-  bool found_job = false;
-  int64_t i, j;
-  while ( not found_job ) {
-    if ( ++ job_num_ >= last_job_ ) return 1;
-    i = job_num_ / N_;
-    j = job_num_ % N_;
-    if ( i < j ) break;
+  // A job is a batch of up to batch_size_ pairs (result index, i, j);
+  // workers look up the points by index in their own configuration
+  std::vector<int64_t> batch;
+  while ( batch . size () < 3 * batch_size_ . size () ) {
+    if ( ++ job_num_ >= last_job_ ) break;
+    int64_t i = job_num_ / N_;
+    int64_t j = job_num_ % N_;
+    if ( not ( i < j ) ) continue;
+    // Distances computed before (by any run) are not sent
+    if ( store_ && store_ -> find ( hashes_ [ i ], hashes_ [ j ], 
+                                    &results_ [ result_index_ ] ) ) {
+      ++ result_index_;
+      continue;
+    }
+    //std::cout << "prepare. preparing job (" << i << ", " << j << ")\n";
+    batch . push_back ( result_index_ ++ );
+    batch . push_back ( i );
+    batch . push_back ( j );
+  }
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+  if ( not batch . empty () ) {
+    OutstandingBatch & outstanding = outstanding_ [ batch [ 0 ] ];
+    outstanding . batch = batch;
+    outstanding . issued = now;
+    outstanding . duplicated = false;
+    job << batch;
+    job << (int64_t) 0;
+    job << 0.0;
+    //std::cout << "preparing complete.\n";
+    return 0;
+  }
+  // Every pair has been sent. Idle workers take over the oldest batch 
+  // which is taking far longer than expected, or wait to see if one will.
+  // Round trips vary with the load of the coordinator and the network,
+  // so none is taken for a straggler before it is a second old.
+  if ( straggler_factor_ <= 0.0 ) return 1;
+  const double min_age = 1.0;
+  double mean = ( completed_ > 0 ) ? completed_seconds_ / (double) completed_ : 0.0;
+  std::map<int64_t, OutstandingBatch>::iterator oldest = outstanding_ . end ();
+  for ( std::map<int64_t, OutstandingBatch>::iterator it = outstanding_ . begin ();
+        it != outstanding_ . end (); ++ it ) {
+    if ( it -> second . duplicated ) continue;
+    if ( oldest == outstanding_ . end () || 
+         it -> second . issued < oldest -> second . issued ) oldest = it;
+  }
+  if ( oldest == outstanding_ . end () ) return 1;
+  double age = std::chrono::duration<double> ( now - oldest -> second . issued ) . count ();
+  double threshold = std::max ( straggler_factor_ * mean, min_age );
+  if ( completed_ > 0 && age >= threshold ) {
+    oldest -> second . duplicated = true;
+    job << oldest -> second . batch;
+    job << (int64_t) 1;
+    job << 0.0;
+    return 0;
   }
-  //std::cout << "prepare. preparing job (" << i << ", " << j << ")\n";
-  job << result_index_ ++;
-  job << subsamples_[i];
-  job << subsamples_[j];
-  //std::cout << "preparing complete.\n";
+  // Wait until the oldest batch becomes a straggler
+  double wait = ( completed_ > 0 ) ? threshold - age : 0.01;
+  job << std::vector<int64_t> ();
+  job << (int64_t) 0;
+  job << std::min ( std::max ( wait, 0.001 ), 1.0 );
   return 0;
 }
 
 void ComputeMatrixProcess::
 work ( Message & result, const Message & job ) const {
   //std::cout << "working...\n";
-  int64_t id;
-  Point x, y;
-  job >> id;
-  job >> x;
-  job >> y;
-  result << id;
-  result << distance_ ( x, y );
+  std::vector<int64_t> batch;
+  int64_t duplicate;
+  double wait;
+  job >> batch;
+  job >> duplicate;
+  job >> wait;
+  if ( batch . empty () ) {
+    boost::this_thread::sleep ( boost::posix_time::microseconds ( (int64_t) ( wait * 1000000.0 ) ) );
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  std::vector<Point> const& subsamples = config_ . getSubsamples ();
+  std::vector<int64_t> ids;
+  std::vector<double> distances;
+  for ( int64_t k = 0; k < batch . size (); k += 3 ) {
+    ids . push_back ( batch [ k ] );
+    distances . push_back ( distance_ ( subsamples [ batch [ k + 1 ] ], 
+                                        subsamples [ batch [ k + 2 ] ] ) );
+  }
+  result << ids;
+  result << distances;
+  result << duplicate;
+  result << std::chrono::duration<double> 
+    ( std::chrono::steady_clock::now () - start ) . count ();
   //std::cout << "working complete.\n";
 }
 
 void ComputeMatrixProcess::
 accept ( const Message &result ) {
   //std::cout << "accept.\n";
-  int64_t id;
-  double distance;
-  result >> id;
-  result >> distance;
-  //std::cout << "accepting result " << id << " " << distance << "\n";
-  results_ [ id ] = distance;
+  std::vector<int64_t> ids;
+  std::vector<double> distances;
+  int64_t duplicate;
+  double seconds;
+  result >> ids;
+  result >> distances;
+  result >> duplicate;
+  result >> seconds;
+  if ( ids . empty () ) return;
+  std::map<int64_t, OutstandingBatch>::iterator it = outstanding_ . find ( ids [ 0 ] );
+  // The other copy of a duplicated batch was received first
+  if ( it == outstanding_ . end () ) return;
+  double round_trip = std::chrono::duration<double> 
+    ( std::chrono::steady_clock::now () - it -> second . issued ) . count ();
+  if ( not duplicate ) batch_size_ . record ( ids . size (), seconds, round_trip );
+  if ( store_ ) {
+    std::vector<int64_t> const& batch = it -> second . batch;
+    for ( int64_t k = 0; k < ids . size (); ++ k ) {
+      store_ -> insert ( hashes_ [ batch [ 3 * k + 1 ] ], hashes_ [ batch [ 3 * k + 2 ] ], 
+                         distances [ k ] );
+    }
+  }
+  outstanding_ . erase ( it );
+  if ( not duplicate ) {
+    completed_seconds_ += round_trip;
+    ++ completed_;
+  }
+  for ( int64_t k = 0; k < ids . size (); ++ k ) {
+    //std::cout << "accepting result " << ids[k] << " " << distances[k] << "\n";
+    results_ [ ids [ k ] ] = distances [ k ];
+  }
   //std::cout << "accepted.\n";
 }
 
@@ -99,6 +217,7 @@ finalize ( void ) {
   }
   outfile << "\n";
   outfile . close ();
+  if ( store_ ) store_ -> flush ();
 }
 
 int main ( int argc, char * argv [] ) {
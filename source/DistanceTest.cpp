@@ -0,0 +1,409 @@
+/// DistanceTest.cpp
+///   Check the persistence diagram distance solvers against simple
+///   reference computations, on the diagrams of a sample and on random
+///   diagrams large enough for the solvers meant for large diagrams
+///   (some with the large deaths the loader puts in place of infinite
+///   ones). Each check prints the number of comparisons and failures.
+///   Usage: DistanceTest /path/to/sample.json
+///   Exits with status 1 if a check fails.
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <functional>
+#include <numeric>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include "persistence/PersistenceDiagram.h"
+#include "persistence/GeometricBottleneckDistance.h"
+#include "persistence/BottleneckDistance.h"
+#include "persistence/WassersteinDistance.h"
+#include "persistence/AuctionWassersteinDistance.h"
+#include "subsample/SubsampleConfig.h" // Defines class Point, class Distance
+
+typedef std::pair<PersistenceDiagram, PersistenceDiagram> DiagramPair;
+
+/// randomDiagram
+///   Return a diagram of "size" generators with births uniform in
+///   [0,10) and persistence uniform in [0,10), of which the first
+///   "essential" die at 100000 (as infinite generators are loaded)
+PersistenceDiagram
+randomDiagram ( std::mt19937 & engine, int64_t size, int64_t essential ) {
+  std::uniform_real_distribution<double> uniform ( 0.0, 10.0 );
+  std::vector<Generator> generators;
+  for ( int64_t i = 0; i < size; ++ i ) {
+    double birth = uniform ( engine );
+    double death = ( i < essential ) ? 100000.0 : birth + uniform ( engine );
+    generators . push_back ( Generator ( birth, death ) );
+  }
+  PersistenceDiagram diagram;
+  diagram . assign ( generators . begin (), generators . end () );
+  return diagram;
+}
+
+/// matching
+///   Return true if the bipartite graph with adjacency lists "edges"
+///   (from the first side to the second, both of "edges . size ()"
+///   vertices) has a perfect matching, by augmenting paths
+bool
+matching ( std::vector<std::vector<int> > const& edges ) {
+  int n = edges . size ();
+  std::vector<int> pair ( n, -1 ); // by second side vertex
+  for ( int u = 0; u < n; ++ u ) {
+    std::vector<bool> visited ( n, false );
+    std::function<bool(int)> augment = [&] ( int v ) {
+      for ( int w : edges [ v ] ) {
+        if ( visited [ w ] ) continue;
+        visited [ w ] = true;
+        if ( pair [ w ] == -1 || augment ( pair [ w ] ) ) {
+          pair [ w ] = v;
+          return true;
+        }
+      }
+      return false;
+    };
+    if ( not augment ( u ) ) return false;
+  }
+  return true;
+}
+
+/// referenceBottleneck
+///   Return the bottleneck distance, the smallest edge length for which
+///   the complete graph of generators and diagonal points has a perfect
+///   matching, by binary search over all the edge lengths
+double
+referenceBottleneck ( PersistenceDiagram const& diagram_1,
+                      PersistenceDiagram const& diagram_2 ) {
+  Generator::Distance distance;
+  int n1 = diagram_1 . size ();
+  int n2 = diagram_2 . size ();
+  int n = n1 + n2;
+  if ( n == 0 ) return 0.0;
+  // The first side is the generators of diagram_1 and the diagonal
+  // points of diagram_2, the second the generators of diagram_2 and
+  // the diagonal points of diagram_1
+  std::vector<std::vector<double> > length ( n, std::vector<double>
+    ( n, std::numeric_limits<double>::infinity () ) );
+  for ( int i = 0; i < n1; ++ i ) {
+    for ( int j = 0; j < n2; ++ j ) length [ i ] [ j ] = distance ( diagram_1 [ i ], diagram_2 [ j ] );
+    length [ i ] [ n2 + i ] = distance . diagonal ( diagram_1 [ i ] );
+  }
+  for ( int j = 0; j < n2; ++ j ) {
+    length [ n1 + j ] [ j ] = distance . diagonal ( diagram_2 [ j ] );
+    for ( int i = 0; i < n1; ++ i ) length [ n1 + j ] [ n2 + i ] = 0.0;
+  }
+  std::vector<double> lengths;
+  for ( std::vector<double> const& row : length ) {
+    for ( double x : row ) if ( not std::isinf ( x ) ) lengths . push_back ( x );
+  }
+  std::sort ( lengths . begin (), lengths . end () );
+  lengths . erase ( std::unique ( lengths . begin (), lengths . end () ), lengths . end () );
+  auto feasible = [&] ( double r ) {
+    std::vector<std::vector<int> > edges ( n );
+    for ( int u = 0; u < n; ++ u ) {
+      for ( int v = 0; v < n; ++ v ) if ( length [ u ] [ v ] <= r ) edges [ u ] . push_back ( v );
+    }
+    return matching ( edges );
+  };
+  int64_t first = 0;
+  int64_t last = lengths . size () - 1;
+  while ( first < last ) {
+    int64_t mid = ( first + last ) / 2;
+    if ( feasible ( lengths [ mid ] ) ) last = mid; else first = mid + 1;
+  }
+  return lengths [ first ];
+}
+
+/// referenceWasserstein
+///   Return the Wasserstein-p distance by the Hungarian algorithm on the
+///   full cost matrix
+double
+referenceWasserstein ( PersistenceDiagram const& diagram_1,
+                       PersistenceDiagram const& diagram_2,
+                       double p ) {
+  int n = diagram_1 . size () + diagram_2 . size ();
+  if ( n == 0 ) return 0.0;
+  std::vector<double> matrix = WassersteinDistance_detail::CostMatrix ( diagram_1, diagram_2, p );
+  WassersteinDistance_detail::Hungarian hungarian ( n, matrix . data () );
+  return std::pow ( hungarian . getPrice (), 1.0 / p );
+}
+
+/// referenceDistance
+///   Return the distance between points (of several diagrams) from the
+///   reference distances of their diagrams
+double
+referenceDistance ( Point const& x, Point const& y, double p ) {
+  double result = 0.0;
+  for ( uint64_t k = 0; k < x . pd . size (); ++ k ) {
+    if ( std::isinf ( p ) ) {
+      result = std::max ( result, referenceBottleneck ( x . pd [ k ], y . pd [ k ] ) );
+    } else {
+      result += std::pow ( referenceWasserstein ( x . pd [ k ], y . pd [ k ], p ), p );
+    }
+  }
+  return std::isinf ( p ) ? result : std::pow ( result, 1.0 / p );
+}
+
+/// equal
+///   Return true if "x" and "y" are equal up to rounding
+bool
+equal ( double x, double y ) {
+  return std::abs ( x - y ) <= 1e-9 * std::max ( 1.0, std::abs ( x ) );
+}
+
+/// report
+///   Print the result of a check and return the number of failures
+int64_t
+report ( std::string const& name, int64_t count, int64_t failures ) {
+  std::cout << name << ": " << count << " comparisons, " << failures << " failures\n";
+  return failures;
+}
+
+/// checkGeometricBottleneck
+///   GeometricBottleneckDistance is the reference bottleneck distance
+int64_t
+checkGeometricBottleneck ( std::vector<DiagramPair> const& pairs ) {
+  int64_t failures = 0;
+  for ( DiagramPair const& pair : pairs ) {
+    double expected = referenceBottleneck ( pair . first, pair . second );
+    double result = GeometricBottleneckDistance ( pair . first, pair . second );
+    if ( not equal ( result, expected ) ) {
+      if ( failures ++ < 10 ) std::cout << "  geometric " << result << " != " << expected << "\n";
+    }
+  }
+  return report ( "GeometricBottleneckDistance", pairs . size (), failures );
+}
+
+/// checkMatchingBottleneck
+///   The Hopcroft-Karp search of BottleneckDistance (used for small
+///   diagrams, but checked here on all of them) is the reference
+///   bottleneck distance, and so is BottleneckDistance
+int64_t
+checkMatchingBottleneck ( std::vector<DiagramPair> const& pairs ) {
+  int64_t failures = 0;
+  for ( DiagramPair const& pair : pairs ) {
+    double expected = referenceBottleneck ( pair . first, pair . second );
+    double matching = BottleneckDistance_detail::MatchingBottleneckDistance 
+      ( pair . first, pair . second, std::numeric_limits<double>::infinity () );
+    double result = BottleneckDistance ( pair . first, pair . second );
+    if ( not equal ( matching, expected ) || not equal ( result, expected ) ) {
+      if ( failures ++ < 10 ) {
+        std::cout << "  matching " << matching << ", bottleneck " << result
+                  << " != " << expected << "\n";
+      }
+    }
+  }
+  return report ( "BottleneckDistance", pairs . size (), failures );
+}
+
+/// checkAuction
+///   AuctionWassersteinDistance is at least the reference Wasserstein
+///   distance and at most 1 + relative_error times it, and the distance
+///   from a diagram to itself is 0
+int64_t
+checkAuction ( std::vector<DiagramPair> const& pairs ) {
+  int64_t count = 0;
+  int64_t failures = 0;
+  for ( DiagramPair const& pair : pairs ) {
+    for ( double p : { 1.0, 2.0, 3.0 } ) {
+      double expected = referenceWasserstein ( pair . first, pair . second, p );
+      for ( double relative_error : { 0.01, 0.1 } ) {
+        ++ count;
+        double result = AuctionWassersteinDistance ( pair . first, pair . second, 
+                                                     p, relative_error );
+        double self = AuctionWassersteinDistance ( pair . first, pair . first, 
+                                                   p, relative_error );
+        if ( result < expected * ( 1.0 - 1e-9 ) ||
+             result > expected * ( 1.0 + relative_error ) * ( 1.0 + 1e-9 ) + 1e-12 ||
+             self != 0.0 ) {
+          if ( failures ++ < 10 ) {
+            std::cout << "  auction p=" << p << " e=" << relative_error << ": " 
+                      << result << " for " << expected << ", self " << self << "\n";
+          }
+        }
+      }
+    }
+  }
+  return report ( "AuctionWassersteinDistance", count, failures );
+}
+
+/// checkWasserstein
+///   WassersteinDistance (by the Jonker-Volgenant algorithm) is the
+///   reference Wasserstein distance
+int64_t
+checkWasserstein ( std::vector<DiagramPair> const& pairs ) {
+  int64_t count = 0;
+  int64_t failures = 0;
+  for ( DiagramPair const& pair : pairs ) {
+    for ( double p : { 1.0, 2.0, 3.0 } ) {
+      ++ count;
+      double expected = referenceWasserstein ( pair . first, pair . second, p );
+      double result = WassersteinDistance ( pair . first, pair . second, p );
+      if ( not equal ( result, expected ) ) {
+        if ( failures ++ < 10 ) {
+          std::cout << "  wasserstein p=" << p << ": " << result << " != " << expected << "\n";
+        }
+      }
+    }
+  }
+  return report ( "WassersteinDistance", count, failures );
+}
+
+/// bounded
+///   Return true if "result", of a call with "bound" for a distance of
+///   "expected" (approximated within "relative_error"), is correct: if
+///   it is at most the bound it is the distance (or its approximation),
+///   and otherwise it is a lower bound on the distance
+bool
+bounded ( double result, double expected, double relative_error, double bound ) {
+  double upper = expected * ( 1.0 + relative_error ) * ( 1.0 + 1e-9 ) + 1e-12;
+  double lower = expected * ( 1.0 - 1e-9 ) - 1e-12;
+  if ( result <= bound ) return result >= lower && result <= upper;
+  return result <= upper;
+}
+
+/// checkBounds
+///   Every solver (and Distance on points of several diagrams), called
+///   with bounds below, at and above the distance, returns the distance
+///   or a lower bound on it above the bound
+int64_t
+checkBounds ( std::vector<DiagramPair> const& pairs,
+              std::vector<std::pair<Point, Point> > const& points ) {
+  int64_t count = 0;
+  int64_t failures = 0;
+  auto check = [&] ( std::string const& name, double result, double expected,
+                     double relative_error, double bound ) {
+    ++ count;
+    if ( not bounded ( result, expected, relative_error, bound ) ) {
+      if ( failures ++ < 10 ) {
+        std::cout << "  " << name << " with bound " << bound << ": " << result
+                  << " for " << expected << "\n";
+      }
+    }
+  };
+  std::vector<double> factors = { 0.0, 0.5, 0.999, 1.0, 1.001, 2.0 };
+  for ( DiagramPair const& pair : pairs ) {
+    PersistenceDiagram const& a = pair . first;
+    PersistenceDiagram const& b = pair . second;
+    double bottleneck = referenceBottleneck ( a, b );
+    for ( double factor : factors ) {
+      double bound = factor * bottleneck;
+      check ( "geometric", GeometricBottleneckDistance ( a, b, bound ), bottleneck, 0.0, bound );
+      check ( "matching", BottleneckDistance_detail::MatchingBottleneckDistance ( a, b, bound ), 
+              bottleneck, 0.0, bound );
+      check ( "bottleneck", BottleneckDistance ( a, b, bound ), bottleneck, 0.0, bound );
+    }
+    for ( double p : { 1.0, 2.0 } ) {
+      double wasserstein = referenceWasserstein ( a, b, p );
+      for ( double factor : factors ) {
+        double bound = factor * wasserstein;
+        check ( "wasserstein", WassersteinDistance ( a, b, p, bound ), wasserstein, 0.0, bound );
+        check ( "auction", AuctionWassersteinDistance ( a, b, p, 0.01, bound ), 
+                wasserstein, 0.01, bound );
+      }
+    }
+  }
+  for ( std::pair<Point, Point> const& pair : points ) {
+    for ( double p : { 1.0, 2.0, std::numeric_limits<double>::infinity () } ) {
+      double expected = referenceDistance ( pair . first, pair . second, p );
+      for ( double relative_error : { 0.0, 0.01 } ) {
+        if ( std::isinf ( p ) && relative_error > 0.0 ) continue;
+        Distance distance ( p, relative_error );
+        for ( double factor : factors ) {
+          double bound = factor * expected;
+          check ( "Distance", distance ( pair . first, pair . second, bound ), 
+                  expected, relative_error, bound );
+        }
+      }
+    }
+  }
+  return report ( "bounded calls", count, failures );
+}
+
+/// checkLower
+///   Distance::lower, from the summaries of the points, is at most the
+///   reference distance between them, for every pair of points
+int64_t
+checkLower ( std::vector<Point> points ) {
+  int64_t count = 0;
+  int64_t failures = 0;
+  for ( double p : { 1.0, 2.0, std::numeric_limits<double>::infinity () } ) {
+    Distance distance ( p );
+    for ( Point & x : points ) distance . summarize ( &x );
+    for ( int64_t i = 0; i < points . size (); ++ i ) {
+      for ( int64_t j = i; j < points . size (); ++ j ) {
+        ++ count;
+        double expected = referenceDistance ( points [ i ], points [ j ], p );
+        double lower = distance . lower ( points [ i ], points [ j ] );
+        if ( lower > expected ) {
+          if ( failures ++ < 10 ) {
+            std::cout << "  lower p=" << p << ": " << lower << " > " << expected << "\n";
+          }
+        }
+      }
+    }
+  }
+  return report ( "Distance::lower", count, failures );
+}
+
+int main ( int argc, char * argv [] ) {
+  if ( argc < 2 ) {
+    std::cout << "Usage: DistanceTest /path/to/sample.json\n";
+    return 1;
+  }
+  std::ifstream infile ( argv[1] );
+  if ( not infile ) throw std::runtime_error ( std::string ( "Cannot open " ) + argv[1] );
+  json sample = json::parse ( infile );
+  std::vector<int64_t> ids ( sample["sample"] . size () );
+  std::iota ( ids . begin (), ids . end (), 0 );
+  boost::shared_ptr<PersistenceDiagramStore> store;
+  std::vector<Point> points = loadPoints ( sample["sample"], sample["path"], ids, "", &store );
+
+  // Each diagram of a sample is compared with itself and with the
+  // corresponding diagram of another sample, and each sample with
+  // another sample as a point
+  std::vector<DiagramPair> pairs;
+  int64_t N = points . size ();
+  for ( int64_t i = 0; i < N; ++ i ) {
+    for ( int64_t k = 0; k < points [ i ] . pd . size (); ++ k ) {
+      pairs . push_back ( DiagramPair ( points [ i ] . pd [ k ], points [ i ] . pd [ k ] ) );
+      pairs . push_back ( DiagramPair ( points [ i ] . pd [ k ],
+                                        points [ ( 7 * i + 3 ) % N ] . pd [ k ] ) );
+    }
+  }
+  std::vector<std::pair<Point, Point> > point_pairs;
+  for ( int64_t i = 0; i < N; ++ i ) {
+    point_pairs . push_back ( std::make_pair ( points [ i ], points [ ( 7 * i + 3 ) % N ] ) );
+  }
+  std::mt19937 engine ( 0 );
+  for ( int64_t size : { 10, 40, 70, 120 } ) {
+    for ( int64_t essential : { 0, 2 } ) {
+      PersistenceDiagram diagram = randomDiagram ( engine, size, essential );
+      pairs . push_back ( DiagramPair ( diagram, diagram ) );
+      pairs . push_back ( DiagramPair ( diagram, randomDiagram ( engine, size + size / 10, essential ) ) );
+    }
+  }
+
+  // The random diagrams are also points of one diagram
+  std::vector<Point> random_points;
+  for ( DiagramPair const& pair : pairs ) {
+    if ( pair . first . size () < 10 ) continue;
+    random_points . push_back ( Point ( std::vector<PersistenceDiagram> ( 1, pair . second ) ) );
+  }
+
+  int64_t failures = 0;
+  failures += checkGeometricBottleneck ( pairs );
+  failures += checkMatchingBottleneck ( pairs );
+  failures += checkWasserstein ( pairs );
+  failures += checkAuction ( pairs );
+  failures += checkBounds ( pairs, point_pairs );
+  failures += checkLower ( points );
+  failures += checkLower ( random_points );
+  if ( failures > 0 ) {
+    std::cout << "The solvers disagree with the reference.\n";
+    return 1;
+  }
+  return 0;
+}
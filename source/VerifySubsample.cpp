@@ -0,0 +1,125 @@
+/// VerifySubsample.cpp
+///   Check the output of ComputeSubsample against distances computed
+///   directly: the subsample is delta-sparse (no two of its points
+///   closer than delta), every reported witness is a subsample point
+///   within delta, and every reported nearest point is a nearest
+///   subsample point (so the subsample is delta-dense). If the run
+///   approximated distances (relative_error in the output), sparsity
+///   and nearness are only checked up to that error. The output of a
+///   partition is checked on the samples of the partition.
+///   Usage: VerifySubsample /path/to/subsample.json [/path/to/reference.json]
+///   If a reference output is given, the subsamples must be equal.
+///   Exits with status 1 if a check fails.
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+#include "boost/unordered_set.hpp"
+#include "subsample/SubsampleConfig.h" // Defines class Point, class Distance
+
+/// readJSON
+///   Parse the file "filename"
+json
+readJSON ( std::string const& filename ) {
+  std::ifstream infile ( filename );
+  if ( not infile ) throw std::runtime_error ( "Cannot open " + filename );
+  return json::parse ( infile );
+}
+
+int main ( int argc, char * argv [] ) {
+  if ( argc < 2 ) {
+    std::cout << "Usage: VerifySubsample /path/to/subsample.json [/path/to/reference.json]\n";
+    return 1;
+  }
+  json output = readJSON ( argv[1] );
+  double delta = output["delta"];
+  double p = output["p"] . is_string () ? std::numeric_limits<double>::infinity()
+                                        : (double) output["p"];
+  double relative_error = output . count ( "relative_error" ) ?
+                          (double) output["relative_error"] : 0.0;
+  std::vector<int64_t> subsample = output["subsample"] . get<std::vector<int64_t> > ();
+  std::vector<int64_t> nearest;
+  std::vector<int64_t> witness;
+  if ( output . count ( "nearest" ) ) {
+    nearest = output["nearest"] . get<std::vector<int64_t> > ();
+  }
+  if ( output . count ( "witness" ) ) {
+    witness = output["witness"] . get<std::vector<int64_t> > ();
+  }
+  bool partition = output . count ( "partition" ) > 0;
+
+  json sample = readJSON ( output["sample"] );
+  std::vector<int64_t> ids ( sample["sample"] . size () );
+  std::iota ( ids . begin (), ids . end (), 0 );
+  boost::shared_ptr<PersistenceDiagramStore> store;
+  std::vector<Point> points = loadPoints ( sample["sample"], sample["path"], ids, "", &store );
+  Distance distance ( p );
+  // Distances within "tolerance" of each other are taken to be equal
+  auto tolerance = [] ( double x ) { return 1e-9 * std::max ( 1.0, x ); };
+  int64_t failures = 0;
+  auto fail = [&] ( std::string const& message ) {
+    if ( failures ++ < 10 ) std::cout << argv[1] << ": " << message << "\n";
+  };
+
+  if ( argc > 2 ) {
+    std::vector<int64_t> reference =
+      readJSON ( argv[2] )["subsample"] . get<std::vector<int64_t> > ();
+    std::vector<int64_t> sorted = subsample;
+    std::sort ( sorted . begin (), sorted . end () );
+    std::sort ( reference . begin (), reference . end () );
+    if ( sorted != reference ) fail ( std::string ( "subsample differs from " ) + argv[2] );
+  }
+  // Approximate distances of at least delta are distances of at least
+  // delta / ( 1 + relative_error )
+  double sparse = delta / ( 1.0 + relative_error );
+  for ( int64_t i = 0; i < subsample . size (); ++ i ) {
+    for ( int64_t j = i + 1; j < subsample . size (); ++ j ) {
+      double d = distance ( points [ subsample [ i ] ], points [ subsample [ j ] ] );
+      if ( d < sparse - tolerance ( sparse ) ) {
+        fail ( "subsample points " + std::to_string ( subsample [ i ] ) + " and " +
+               std::to_string ( subsample [ j ] ) + " are closer than delta" );
+      }
+    }
+  }
+  boost::unordered_set<int64_t> members ( subsample . begin (), subsample . end () );
+  if ( not witness . empty () && witness . size () != points . size () ) {
+    fail ( "wrong number of witnesses" );
+    witness . clear ();
+  }
+  if ( not nearest . empty () && nearest . size () != points . size () ) {
+    fail ( "wrong number of nearest points" );
+    nearest . clear ();
+  }
+  if ( witness . empty () && nearest . empty () ) fail ( "no witness or nearest points" );
+  for ( Point const& x : points ) {
+    // A partition reports only the samples in it
+    if ( partition && ( witness . empty () || witness [ x . id ] == -1 ) ) continue;
+    if ( not witness . empty () ) {
+      int64_t w = witness [ x . id ];
+      if ( members . count ( w ) == 0 || not ( distance ( x, points [ w ] ) < delta ) ) {
+        fail ( "sample " + std::to_string ( x . id ) + " has no witness within delta" );
+      }
+    }
+    if ( not nearest . empty () ) {
+      int64_t n = nearest [ x . id ];
+      double best = std::numeric_limits<double>::infinity();
+      for ( int64_t id : subsample ) best = std::min ( best, distance ( x, points [ id ] ) );
+      if ( not ( best < delta ) ) {
+        fail ( "sample " + std::to_string ( x . id ) + " is not within delta of the subsample" );
+      }
+      double allowed = best * ( 1.0 + relative_error );
+      if ( members . count ( n ) == 0 ||
+           distance ( x, points [ n ] ) > allowed + tolerance ( allowed ) ) {
+        fail ( "sample " + std::to_string ( x . id ) + " has a wrong nearest subsample point" );
+      }
+    }
+  }
+  std::cout << argv[1] << ": " << points . size () << " samples, "
+            << subsample . size () << " in the subsample, "
+            << failures << " failures\n";
+  return ( failures > 0 ) ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+/// WassersteinBenchmark.cpp
+///   Compare the Hungarian and Jonker-Volgenant assignment solvers used
+///   for the Wasserstein distance on random persistence diagrams: check
+///   that they find the same optimal cost, and report their times.
+///   Usage: WassersteinBenchmark [p] [size ...]
+///   (default p = 1, sizes 50 100 200 400). Exits with status 1 if the
+///   costs differ by more than rounding.
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include "persistence/PersistenceDiagram.h"
+#include "persistence/WassersteinDistance.h"
+
+/// randomDiagram
+///   Return a diagram of "size" generators with births uniform in
+///   [0,10) and persistence uniform in [0,10)
+PersistenceDiagram
+randomDiagram ( std::mt19937 & engine, int64_t size ) {
+  std::uniform_real_distribution<double> uniform ( 0.0, 10.0 );
+  std::vector<Generator> generators;
+  for ( int64_t i = 0; i < size; ++ i ) {
+    double birth = uniform ( engine );
+    double death = birth + uniform ( engine );
+    generators . push_back ( Generator ( birth, death ) );
+  }
+  PersistenceDiagram diagram;
+  diagram . assign ( generators . begin (), generators . end () );
+  return diagram;
+}
+
+int main ( int argc, char * argv [] ) {
+  using namespace WassersteinDistance_detail;
+  double p = ( argc > 1 ) ? std::stod ( argv[1] ) : 1.0;
+  std::vector<int64_t> sizes;
+  for ( int i = 2; i < argc; ++ i ) sizes . push_back ( std::stoll ( argv[i] ) );
+  if ( sizes . empty () ) sizes = { 50, 100, 200, 400 };
+  std::mt19937 engine ( 0 );
+  bool equal = true;
+  std::cout << "size hungarian_cost lapjv_cost hungarian_seconds lapjv_seconds speedup\n";
+  for ( int64_t size : sizes ) {
+    PersistenceDiagram diagram_1 = randomDiagram ( engine, size );
+    PersistenceDiagram diagram_2 = randomDiagram ( engine, size + size / 10 );
+    int n = diagram_1 . size () + diagram_2 . size ();
+    std::vector<double> matrix = CostMatrix ( diagram_1, diagram_2, p );
+    auto start = std::chrono::steady_clock::now ();
+    Hungarian hungarian ( n, matrix . data () );
+    double hungarian_cost = hungarian . getPrice ();
+    auto middle = std::chrono::steady_clock::now ();
+    LAPJV lapjv ( n, matrix . data () );
+    double lapjv_cost = lapjv . getPrice ();
+    auto end = std::chrono::steady_clock::now ();
+    double hungarian_seconds = std::chrono::duration<double> ( middle - start ) . count ();
+    double lapjv_seconds = std::chrono::duration<double> ( end - middle ) . count ();
+    // Optimal assignments may differ where costs tie, so the sums may
+    // differ in the last bits
+    if ( std::abs ( hungarian_cost - lapjv_cost ) > 1e-9 * std::max ( 1.0, hungarian_cost ) ) {
+      equal = false;
+    }
+    std::cout << size << " " << hungarian_cost << " " << lapjv_cost << " "
+              << hungarian_seconds << " " << lapjv_seconds << " "
+              << hungarian_seconds / std::max ( lapjv_seconds, 1e-9 ) << "\n";
+  }
+  if ( not equal ) {
+    std::cout << "The solvers disagree.\n";
+    return 1;
+  }
+  return 0;
+}
@@ -1,9 +1,103 @@
 #!/bin/bash
+set -e
 SHELL_DIR=$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )
 cd $SHELL_DIR
 tar xvfz ./data.tar.gz
 sed 's|REPLACEME|'${SHELL_DIR}'|g' data/sample.json > ./sample.json
+rm -f ./*.store ./*.store.lock ./*.checkpoint ./subsample_stopped*.json
 ./trial.sh 1.0 1.0
 ./trial.sh 100.0 1.0
 ./trial.sh 1.0 inf
 ./trial.sh 10.0 inf
+# The runs below must reproduce the subsamples (and distance matrices) 
+# of the trials, or at least be valid subsamples
+verify () { ../build/bin/VerifySubsample "$@"; }
+# within_error exact approximate relative_error
+within_error () {
+  awk -v e=$3 'NR == FNR { split ( $0, exact ); next }
+    { n = split ( $0, approximate );
+      for ( i = 1; i <= n; ++ i ) {
+        if ( approximate[i] < exact[i] * ( 1 - 1e-6 ) - 1e-9 || 
+             approximate[i] > exact[i] * ( 1 + e ) * ( 1 + 1e-6 ) + 1e-9 ) exit 1;
+      } }' $1 $2
+}
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_resume.json --checkpoint=./subsample.checkpoint
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_resume.json --checkpoint=./subsample.checkpoint --resume
+verify ./subsample_resume.json ./subsample_10.0_inf.json
+# A run stopped at every cohort boundary and resumed each time must
+# reproduce the subsamples of an uninterrupted run (nearest points and
+# witnesses may differ where distances tie)
+rm -f ./subsample.checkpoint
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 100.0,10.0,1.0 1.0 ./subsample_cohorts.json --cohort-size=25
+runs=0
+until [ -e ./subsample_stopped_1.0.json ]; do
+  runs=$(( runs + 1 ))
+  if [ $runs -gt 20 ]; then echo "The stopped run did not finish"; exit 1; fi
+  mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 100.0,10.0,1.0 1.0 ./subsample_stopped.json --cohort-size=25 --checkpoint=./subsample.checkpoint --resume --time-limit=0
+done
+if [ $runs -lt 2 ]; then echo "The run was not stopped"; exit 1; fi
+for delta in 100.0 10.0 1.0; do
+  verify ./subsample_stopped_${delta}.json ./subsample_cohorts_${delta}.json
+done
+if mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_bad.json --checkpoint=./subsample.checkpoint --resume=x; then
+  echo "--resume=x was accepted"; exit 1
+fi
+if mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_bad.json --telemetry-interval=-1; then
+  echo "A negative interval was accepted"; exit 1
+fi
+# An incremental run without new samples keeps the previous subsample
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_incremental.json --incremental=./subsample_10.0_inf.json
+verify ./subsample_incremental.json ./subsample_10.0_inf.json
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 100.0,10.0,1.0 1.0 ./subsample_nested.json
+verify ./subsample_nested_100.0.json ./subsample_100.0_1.0.json
+verify ./subsample_nested_10.0.json
+verify ./subsample_nested_1.0.json
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_store.json --diagram-store=./diagrams.store
+verify ./subsample_store.json ./subsample_10.0_inf.json
+mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_store.json ./distance_store.txt --diagram-store=./diagrams.store
+cmp ./distance_store.txt ./distance_10.0_inf.txt
+# A diagram file that changed since the store was built rebuilds it
+cp ./diagrams.store ./diagrams_old.store
+touch data/UpDown/Out_0_0.txt
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_store.json --diagram-store=./diagrams.store
+verify ./subsample_store.json ./subsample_10.0_inf.json
+if cmp -s ./diagrams.store ./diagrams_old.store; then
+  echo "The diagram store was not rebuilt"; exit 1
+fi
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_part_0.json --partition=0/2
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_part_1.json --partition=1/2
+verify ./subsample_part_0.json
+verify ./subsample_part_1.json
+# The checkpoint of a partition cannot be resumed as another partition
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_part_cp.json --partition=0/2 --checkpoint=./partition.checkpoint
+if mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_part_cp.json --partition=1/2 --checkpoint=./partition.checkpoint --resume; then
+  echo "The checkpoint of another partition was accepted"; exit 1
+fi
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_merged.json --merge=./subsample_part_0.json,./subsample_part_1.json
+verify ./subsample_merged.json
+if mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_part_bad.json --partition=0/1000; then
+  echo "More partitions than samples were accepted"; exit 1
+fi
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_batch.json --batch-size=8
+verify ./subsample_batch.json ./subsample_10.0_inf.json
+mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_batch.json ./distance_straggler.txt --straggler-factor=0.5
+cmp ./distance_straggler.txt ./distance_10.0_inf.txt
+mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_batch.json ./distance_batch.txt --batch-size=auto --max-batch-size=16
+cmp ./distance_batch.txt ./distance_10.0_inf.txt
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_cache.json --cache-memory=0.1
+verify ./subsample_cache.json ./subsample_10.0_inf.json
+# A cache this small keeps evicting distances operations are waiting for
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 100.0 1.0 ./subsample_tiny_cache.json --cache-memory=0.0001 --batch-size=auto --coordinator-threads=4
+verify ./subsample_tiny_cache.json ./subsample_100.0_1.0.json
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 inf ./subsample_stored.json --distance-store=./distances.store
+verify ./subsample_stored.json ./subsample_10.0_inf.json
+mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_stored.json ./distance_stored.txt --distance-store=./distances.store
+cmp ./distance_stored.txt ./distance_10.0_inf.txt
+mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json 10.0 1.0 ./subsample_auction.json --relative-error=0.01
+verify ./subsample_auction.json
+mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_auction.json ./distance_auction.txt --relative-error=0.01
+mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_auction.json ./distance_auction_exact.txt
+within_error ./distance_auction_exact.txt ./distance_auction.txt 0.01
+../build/bin/WassersteinBenchmark 1.0 50 100
+../build/bin/DistanceTest ./sample.json
+echo "All tests passed."
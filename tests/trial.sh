@@ -1,5 +1,7 @@
 #!/bin/bash
+set -e
 SHELL_DIR=$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )
 cd $SHELL_DIR
 mpiexec -np 4 ../build/bin/ComputeSubsample ./sample.json $1 $2 ./subsample_$1_$2.json
+../build/bin/VerifySubsample ./subsample_$1_$2.json
 mpiexec -np 4 ../build/bin/ComputeDistances ./subsample_$1_$2.json ./distance_$1_$2.txt